@@ -24,17 +24,21 @@
 
 struct slv_err;
 struct slv_stream;
+struct slv_writer;
 
 struct slv_asset {
 	const struct slv_asset_ops {
 		bool (*check_args)(const void *);
 		bool (*load)(void *, struct slv_stream *);
+		bool (*validate)(const void *, struct slv_stream *);
 		bool (*save)(const void *);
+		bool (*list)(void *, struct slv_stream *, bool);
 		void (*del)(void *);
 	} *ops;
 	char **args; // NULL-terminated
 	char *out;
 	struct slv_err *err;
+	struct slv_writer *writer; // Set while saving
 };
 
 typedef struct slv_asset *slv_asset_ctor(char **, struct slv_err *);
@@ -36,6 +36,42 @@
 #include "stream.h"
 #include "utils.h"
 
+#define TEX_FIELDS(X) \
+	X(cst_0)        \
+	X(width_0)      \
+	X(height)       \
+	X(cst_1)        \
+	X(buf_sz)       \
+	X(width_1)      \
+	X(buf_off)      \
+	X(unk_0)        \
+	X(unk_1)        \
+	X(unk_2)        \
+	X(unk_3)        \
+	X(unk_4)
+
+#define MESH_FIELDS(X) \
+	X(idx)          \
+	X(id)           \
+	X(unk_0)        \
+	X(num_vertices) \
+	X(num_normals)  \
+	X(num_faces)    \
+	X(unk_1)        \
+	X(unk_2)
+
+static const struct slv_field tex_fields[] = {
+#define X(field) SLV_FIELD(struct slv_chr_tex, field),
+	TEX_FIELDS(X)
+#undef X
+};
+
+static const struct slv_field mesh_fields[] = {
+#define X(field) SLV_FIELD(struct slv_chr_mesh, field),
+	MESH_FIELDS(X)
+#undef X
+};
+
 static bool check_args(const void *me)
 {
 	return slv_check_args(me, 5, SLV_ERR_CHR_ARGS);
@@ -67,23 +103,16 @@ static bool load_face(struct slv_chr_face *face, struct slv_stream *stream)
 
 static bool load_mesh(struct slv_chr_mesh *mesh, struct slv_stream *stream)
 {
-	if (!slv_read_le(stream, &mesh->idx)
-	    || !slv_read_le(stream, &mesh->id)
-	    || !slv_read_le(stream, &mesh->unk_0)
-	    || !slv_read_le(stream, &mesh->num_vertices)
+	if (!slv_read_fields(stream, mesh_fields, SLV_LEN(mesh_fields), mesh)
 	    || !(mesh->vertices = slv_malloc(3 * mesh->num_vertices *
 	                                     sizeof mesh->vertices[0],
 	                                     stream->err))
-	    || !slv_read_le(stream, &mesh->num_normals)
 	    || !(mesh->normals = slv_malloc(3 * mesh->num_normals *
 	                                    sizeof mesh->normals[0],
 	                                    stream->err))
-	    || !slv_read_le(stream, &mesh->num_faces)
 	    || !(mesh->faces = slv_alloc(mesh->num_faces, sizeof mesh->faces[0],
 	                                 &(struct slv_chr_face) {0},
 	                                 stream->err))
-	    || !slv_read_le(stream, &mesh->unk_1)
-	    || !slv_read_le(stream, &mesh->unk_2)
 	    || !slv_read_le_arr(stream, SLV_LEN(mesh->origin), &mesh->origin[0])
 	    || !slv_read_le_arr(stream, SLV_LEN(mesh->matrix), &mesh->matrix[0])
 	    || !slv_read_le_arr(stream, 3 * mesh->num_vertices, mesh->vertices)
@@ -170,15 +199,18 @@ static bool load_mesh_groups(struct slv_chr_root *root,
 	return true;
 }
 
-static bool load_chunk(struct slv_chr *chr, struct slv_stream *stream,
+static bool load_chunk(struct slv_chr *chr, struct slv_stream *parent,
                        size_t mesh_idx)
 {
 	struct slv_chr_chunk chunk;
-	if (!slv_read_le(stream, &chunk.id)
-	    || !slv_read_le(stream, &chunk.sz))
+	struct slv_stream *stream;
+	// Reading past the end of a chunk fails in its sub-stream
+	if (!slv_read_le(parent, &chunk.id)
+	    || !slv_read_le(parent, &chunk.sz)
+	    || !(stream = slv_new_sub(parent, chunk.sz)))
 		return false;
 	struct slv_chr_root *root = &chr->root;
-	size_t pos = stream->pos;
+	bool ret = false;
 	switch (chunk.id) {
 	case 0x7f01: {
 		struct slv_chr_mat_offsets *o = &root->mat_offsets;
@@ -188,14 +220,14 @@ static bool load_chunk(struct slv_chr *chr, struct slv_stream *stream,
 		                                 sizeof o->offsets[0],
 		                                 stream->err))
 		    || !slv_read_le_arr(stream, o->num_offsets, o->offsets))
-			return false;
+			goto del_stream;
 		break;
 	}
 	case 0x7f02: {
 		struct slv_chr_mesh *mesh = &root->meshes.meshes[mesh_idx];
 		mesh->chunk = chunk;
 		if (!load_mesh(mesh, stream))
-			return false;
+			goto del_stream;
 		/*
 		 * Some models have broken mesh ids (BOOTS2.CHR, EROCK1.CHR,
 		 * EROCK2.CHR, EROCK3.CHR, Ringb.chr, RING2.CHR, VILLAGR2.CHR)
@@ -206,39 +238,29 @@ static bool load_chunk(struct slv_chr *chr, struct slv_stream *stream,
 	case 0x7f03:
 		root->meshes.chunk = chunk;
 		if (!load_meshes(chr, stream))
-			return false;
+			goto del_stream;
 		break;
 	case 0x7f04: {
 		struct slv_chr_tex *tex = &root->tex;
 		tex->chunk = chunk;
-		if (!slv_read_le(stream, &tex->cst_0)
-		    || !slv_read_le(stream, &tex->width_0)
-		    || !slv_read_le(stream, &tex->height)
-		    || !(tex->unks = slv_malloc(tex->height *
-		                                sizeof tex->unks[0],
-		                                stream->err))
-		    || !slv_read_le(stream, &tex->cst_1)
-		    || !slv_read_le(stream, &tex->buf_sz))
-			return false;
+		if (!slv_read_fields(stream, tex_fields, SLV_LEN(tex_fields),
+		                     tex))
+			goto del_stream;
 		if (tex->buf_sz <= 8) {
 			/*
 			 * The last 8 pixels of every CHR texture are missing
 			 * (the game wrongly overreads them into the next chunk)
 			 */
 			slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_TEX);
-			return false;
+			goto del_stream;
 		}
-		if (!(tex->buf = slv_malloc(tex->buf_sz, stream->err))
-		    || !slv_read_le(stream, &tex->width_1)
-		    || !slv_read_le(stream, &tex->buf_off)
-		    || !slv_read_le(stream, &tex->unk_0)
-		    || !slv_read_le(stream, &tex->unk_1)
-		    || !slv_read_le(stream, &tex->unk_2)
-		    || !slv_read_le(stream, &tex->unk_3)
-		    || !slv_read_le(stream, &tex->unk_4)
+		if (!(tex->unks = slv_malloc(tex->height *
+		                             sizeof tex->unks[0],
+		                             stream->err))
+		    || !(tex->buf = slv_malloc(tex->buf_sz, stream->err))
 		    || !slv_read_le_arr(stream, tex->height, tex->unks)
 		    || !slv_read_buf(stream, tex->buf, tex->buf_sz - 8))
-			return false;
+			goto del_stream;
 		memset(&tex->buf[tex->buf_sz - 8], 0, 8);
 		break;
 	}
@@ -246,18 +268,18 @@ static bool load_chunk(struct slv_chr *chr, struct slv_stream *stream,
 		struct slv_chr_nodes *nodes = &root->nodes;
 		nodes->chunk = chunk;
 		if (!load_nodes(nodes, stream))
-			return false;
+			goto del_stream;
 		break;
 	}
 	case 0x7f06:
 		root->mesh_groups.chunk = chunk;
 		if (!load_mesh_groups(root, stream))
-			return false;
+			goto del_stream;
 		break;
 	case 0x8000:
 		chr->chunk = chunk;
 		if (!load_chunk(chr, stream, 0))
-			return false;
+			goto del_stream;
 		break;
 	case 0x8001:
 		root->chunk = chunk;
@@ -266,17 +288,20 @@ static bool load_chunk(struct slv_chr *chr, struct slv_stream *stream,
 		    || !load_chunk(chr, stream, 0) // Texture
 		    || !load_chunk(chr, stream, 0) // Nodes
 		    || !load_chunk(chr, stream, 0)) // Mesh groups
-			return false;
+			goto del_stream;
 		break;
 	default:
 		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_CHUNK_ID);
-		return false;
+		goto del_stream;
 	}
-	if (pos + chunk.sz != stream->pos) {
+	if (stream->pos != chunk.sz) {
 		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_CHUNK_SZ);
-		return false;
+		goto del_stream;
 	}
-	return true;
+	ret = true;
+del_stream:
+	SLV_DEL(stream);
+	return ret;
 }
 
 static bool load(void *me, struct slv_stream *stream)
@@ -284,12 +309,204 @@ static bool load(void *me, struct slv_stream *stream)
 	return load_chunk(me, stream, 0);
 }
 
+// What the chunks walked so far tell about the indices in those that follow
+struct counts {
+	unsigned long num_offsets;
+	unsigned long num_meshes;
+	unsigned long fst_mesh_id;
+	unsigned long num_nodes;
+};
+
+// Faces are 8 bytes, followed by 16 bytes per vertex
+static bool validate_mesh(const struct counts *counts,
+                          struct slv_stream *stream)
+{
+	struct slv_chr_mesh mesh;
+	if (!slv_read_fields(stream, mesh_fields, SLV_LEN(mesh_fields), &mesh)
+	    || !slv_skip(stream, SLV_LEN(mesh.origin) + SLV_LEN(mesh.matrix), 4)
+	    || !slv_skip(stream, 3 * mesh.num_vertices, 4)
+	    || !slv_skip(stream, 3 * mesh.num_normals, 4))
+		return false;
+	for (size_t i = 0; i < mesh.num_faces; ++i) {
+		struct slv_chr_face face;
+		if (!slv_read_buf(stream, &face.flags, 1)
+		    || !slv_read_buf(stream, &face.idx, 1)
+		    || !slv_read_buf(stream, &face.num_vertices, 1)
+		    || !slv_read_buf(stream, &face.mat_off_idx, 1)
+		    || !slv_skip(stream, 1, 4))
+			return false;
+		// Only faces colored by index look their material offset up
+		if ((face.flags & SLV_CHR_COLOR_IDX)
+		    && face.mat_off_idx >= counts->num_offsets) {
+			slv_set_err(stream->err, SLV_LIB_SLV,
+			            SLV_ERR_CHR_MAT_OFF);
+			return false;
+		}
+		for (size_t j = 0; j < face.num_vertices; ++j) {
+			unsigned long idx;
+			if (!slv_read_le(stream, &idx)
+			    || !slv_skip(stream, 3, 4))
+				return false;
+			if (idx >= mesh.num_vertices) {
+				slv_set_err(stream->err, SLV_LIB_SLV,
+				            SLV_ERR_CHR_VTX);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The texture is saved as a GIF file of width_0 by height pixels
+static bool validate_tex(struct slv_stream *stream)
+{
+	struct slv_chr_tex tex;
+	if (!slv_read_fields(stream, tex_fields, SLV_LEN(tex_fields), &tex))
+		return false;
+	if (tex.buf_sz <= 8) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_TEX);
+		return false;
+	}
+	if (!tex.width_0 || tex.height > tex.buf_sz / tex.width_0) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_TEX_RES);
+		return false;
+	}
+	return slv_skip(stream, tex.height, 4)
+	       && slv_skip(stream, tex.buf_sz - 8, 1);
+}
+
+static bool validate_mesh_id(const struct counts *counts,
+                             struct slv_stream *stream)
+{
+	unsigned long id;
+	if (!slv_read_le(stream, &id))
+		return false;
+	if (id < counts->fst_mesh_id
+	    || id - counts->fst_mesh_id >= counts->num_meshes) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_MESH_ID);
+		return false;
+	}
+	return true;
+}
+
+static bool validate_mesh_groups(const struct counts *counts,
+                                 struct slv_stream *stream)
+{
+	for (size_t i = 0; i < counts->num_nodes; ++i) {
+		unsigned long type;
+		unsigned long num_mesh_ids;
+		if (!slv_read_le(stream, &type))
+			return false;
+		switch (type) {
+		case SLV_CHR_GROUP_TYPE_NONE:
+			continue;
+		case SLV_CHR_GROUP_TYPE_SINGLE:
+			if (!validate_mesh_id(counts, stream))
+				return false;
+			continue;
+		case SLV_CHR_GROUP_TYPE_ARR:
+			if (!slv_read_le(stream, &num_mesh_ids))
+				return false;
+			for (size_t j = 0; j < num_mesh_ids; ++j)
+				if (!validate_mesh_id(counts, stream))
+					return false;
+			continue;
+		}
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_GROUP_TYPE);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Walks the chunk tree like load_chunk, without decoding or allocating. Every
+ * chunk must be the one save expects there, which load_chunk takes for granted.
+ */
+static bool validate_chunk(unsigned long id, struct counts *counts,
+                           struct slv_stream *parent)
+{
+	struct slv_chr_chunk chunk;
+	struct slv_stream *stream;
+	if (!slv_read_le(parent, &chunk.id)
+	    || !slv_read_le(parent, &chunk.sz)
+	    || !(stream = slv_new_sub(parent, chunk.sz)))
+		return false;
+	bool ret = false;
+	if (chunk.id != id) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_CHUNK_ID);
+		goto del_stream;
+	}
+	switch (chunk.id) {
+	case 0x7f01:
+		if (!slv_read_le(stream, &counts->num_offsets)
+		    || !slv_skip(stream, counts->num_offsets, 4))
+			goto del_stream;
+		break;
+	case 0x7f02:
+		if (!validate_mesh(counts, stream))
+			goto del_stream;
+		break;
+	case 0x7f03:
+		if (!slv_read_le(stream, &counts->num_meshes)
+		    || !slv_read_le(stream, &counts->fst_mesh_id))
+			goto del_stream;
+		for (size_t i = 0; i < counts->num_meshes; ++i)
+			if (!validate_chunk(0x7f02, counts, stream))
+				goto del_stream;
+		break;
+	case 0x7f04:
+		if (!validate_tex(stream))
+			goto del_stream;
+		break;
+	case 0x7f05:
+		if (!slv_skip(stream, 1, 4)
+		    || !slv_read_le(stream, &counts->num_nodes)
+		    || !slv_skip(stream, counts->num_nodes, 16))
+			goto del_stream;
+		break;
+	case 0x7f06:
+		if (!validate_mesh_groups(counts, stream))
+			goto del_stream;
+		break;
+	case 0x8000:
+		if (!validate_chunk(0x8001, counts, stream))
+			goto del_stream;
+		break;
+	case 0x8001: {
+		// Material offsets, meshes, texture, nodes and mesh groups
+		static const unsigned long ids[] = {
+			0x7f01, 0x7f03, 0x7f04, 0x7f05, 0x7f06,
+		};
+		for (size_t i = 0; i < SLV_LEN(ids); ++i)
+			if (!validate_chunk(ids[i], counts, stream))
+				goto del_stream;
+		break;
+	}
+	}
+	if (stream->pos != chunk.sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_CHR_CHUNK_SZ);
+		goto del_stream;
+	}
+	ret = true;
+del_stream:
+	SLV_DEL(stream);
+	return ret;
+}
+
+static bool validate(const void *me, struct slv_stream *stream)
+{
+	(void)me;
+	struct counts counts = {0};
+	return validate_chunk(0x8000, &counts, stream);
+}
+
 struct tess_ctx {
 	struct GLUtesselator *tess;
 	void (*tesselate)(size_t, struct tess_ctx *);
 	size_t prev_vtx_indices[2];
 	size_t cur_vtx;
 	size_t cur_tess_tri;
+	size_t num_tess_tris;
 	size_t num_tris;
 	struct tess_tri {
 		size_t indices[3];
@@ -305,6 +522,11 @@ struct tess_ctx {
 
 static void add_tri(const size_t *tri, struct tess_ctx *ctx)
 {
+	if (ctx->cur_tess_tri == ctx->num_tess_tris) {
+		slv_set_err(ctx->err, SLV_LIB_SLV, SLV_ERR_OVERFLOW);
+		ctx->has_err = true;
+		return;
+	}
 	struct tess_tri *tess_tri = &ctx->tess_tris[ctx->cur_tess_tri++];
 	memcpy(tess_tri->indices, tri, sizeof tess_tri->indices);
 }
@@ -454,10 +676,10 @@ static bool tesselate(const struct slv_chr_face *face, struct tess_ctx *ctx)
 	                                       sizeof vertices[0], ctx->err);
 	if (!vertices)
 		return false;
-	size_t num_tess_tris = face->num_vertices;
-	num_tess_tris -= 2;
+	ctx->num_tess_tris = face->num_vertices;
+	ctx->num_tess_tris -= 2;
 	bool ret = false;
-	if (!(ctx->tess_tris = slv_malloc(num_tess_tris *
+	if (!(ctx->tess_tris = slv_malloc(ctx->num_tess_tris *
 	                                  sizeof ctx->tess_tris[0], ctx->err)))
 		goto free_vertices;
 	ctx->cur_tess_tri = 0;
@@ -476,8 +698,9 @@ static bool tesselate(const struct slv_chr_face *face, struct tess_ctx *ctx)
 	gluTessEndPolygon(ctx->tess);
 	if (ctx->has_err)
 		goto free_tess_tris;
+	// Degenerate polygons are split in fewer triangles
 	struct slv_chr_face tess_face = *face;
-	for (size_t i = 0; i < num_tess_tris; ++i) {
+	for (size_t i = 0; i < ctx->cur_tess_tri; ++i) {
 		const struct tess_tri *tri = &ctx->tess_tris[i];
 		tess_face.vertices = (struct slv_chr_face_vtx[]) {
 			face->vertices[tri->indices[0]],
@@ -638,6 +861,7 @@ static bool save(const void *me)
 	    || !slv_ul_to_i(tex->height, &height, chr->asset.err))
 		return false;
 	struct GifFileType *gif = slv_open_gif(&(struct slv_gif_opts) {
+		.writer = chr->asset.writer,
 		.file_path = chr->asset.args[3],
 		.num_colors = SLV_NUM_PAL_COLORS,
 		.colors = pal_colors,
@@ -704,7 +928,7 @@ del_tess:
 free_file:
 	lib3ds_file_free(file);
 close_gif:
-	EGifCloseFile(gif, NULL);
+	slv_close_gif(gif);
 	return ret;
 }
 
@@ -749,6 +973,7 @@ static void del(void *me)
 static const struct slv_asset_ops ops = {
 	.check_args = check_args,
 	.load = load,
+	.validate = validate,
 	.save = save,
 	.del = del,
 };
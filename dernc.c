@@ -2,9 +2,15 @@
  * dernc.c   decompress RNC data
  *
  * Compiled normally, this file is a well-behaved, re-entrant code
- * module exporting only `rnc_ulen', `rnc_unpack' and `rnc_error'.
+ * module exporting only `rnc_ulen', `rnc_unpack', `rnc_error', the
+ * streaming routines and the CRC routines.
  * Compiled with MAIN defined, it's a standalone program which will
  * decompress argv[1] into argv[2].
+ * Compiled with BENCH defined (and linked with enrnc.c), it's a
+ * benchmark which times `rnc_unpack' and `rnc_crc' on the files
+ * given, or on made-up data if there are none.
+ * Compiled with TEST defined (and linked with enrnc.c), it checks
+ * that corrupt blocks are rejected by the streaming decoder.
  */
 
 #pragma GCC diagnostic push
@@ -12,14 +18,25 @@
 #pragma GCC diagnostic ignored "-Wsign-conversion"
 #pragma GCC diagnostic ignored "-Wconversion"
 
-#ifdef MAIN
+#if defined(MAIN) || defined(BENCH) || defined(TEST)
 # include <stdio.h>
-# include <stdlib.h>
-# include <string.h>
 #endif
+#ifdef BENCH
+# include <time.h>
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define HAVE_RDTSC
+# endif
+#endif
+
+#include <stdlib.h>
+#include <string.h>
 
 #define INTERNAL
 #include "dernc.h"
+#if defined(BENCH) || defined(TEST)
+# include "enrnc.h"
+#endif
 
 #ifdef MAIN
 int main_unpack (char *pname, char *iname, char *oname);
@@ -112,7 +129,7 @@ int main_unpack (char *pname, char *iname, char *oname)
 	return 1;
     }
 
-    unpacked = malloc(ulen);
+    unpacked = malloc(ulen + RNC_UNPACK_SLACK);
     if (!unpacked) {
 	perror(pname);
 	return 1;
@@ -160,11 +177,28 @@ int copy_file (char *iname, char *oname)
 
 #endif
     
+/*
+ * The bit stream is a series of little-endian 16-bit words, with the
+ * literal bytes stored between them. Words are loaded into a 64-bit
+ * buffer up to three at a time; only near the end of the input are
+ * they loaded one by one. See bit_input for where the literals are.
+ */
 typedef struct {
-    unsigned long bitbuf;	       /* holds between 16 and 32 bits */
+    unsigned long long bitbuf;	       /* holds between 32 and 63 bits */
     int bitcount;		       /* how many bits does bitbuf hold? */
+    unsigned char *next;	       /* next word to load */
+    unsigned char *end;		       /* end of the packed data */
 } bit_stream;
 
+/*
+ * Codes of up to HUF_LOOKUP_BITS bits are decoded with a single
+ * lookup of the next bits in the stream; longer ones fall back to a
+ * linear search of the table. The bit buffer always holds at least 32
+ * bits, so a code and the extra bits after it can be peeked at and
+ * skipped together.
+ */
+#define HUF_LOOKUP_BITS 9
+
 typedef struct {
     int num;			       /* number of nodes in the tree */
     struct {
@@ -172,26 +206,42 @@ typedef struct {
 	int codelen;
 	int value;
     } table[32];
+    signed char lookup[1 << HUF_LOOKUP_BITS]; /* table index, or -1 */
 } huf_table;
 
-static void read_huftable (huf_table *h, bit_stream *bs, unsigned char **p);
-static unsigned long huf_read (huf_table *h, bit_stream *bs,
-			       unsigned char **p);
+static void read_huftable (huf_table *h, bit_stream *bs);
+static unsigned long huf_read (huf_table *h, bit_stream *bs);
 
-static void bitread_init (bit_stream *bs, unsigned char **p);
-static void bitread_fix (bit_stream *bs, unsigned char **p);
+static void bitread_init (bit_stream *bs, unsigned char *p,
+			  unsigned char *end);
+static void bitread_fix (bit_stream *bs, unsigned char *p);
+static void bit_refill (bit_stream *bs);
+static unsigned char *bit_input (bit_stream *bs);
 static unsigned long bit_peek (bit_stream *bs, unsigned long mask);
-static void bit_advance (bit_stream *bs, int n, unsigned char **p);
-static unsigned long bit_read (bit_stream *bs, unsigned long mask,
-			       int n, unsigned char **p);
+static void bit_advance (bit_stream *bs, int n);
+static unsigned long bit_read (bit_stream *bs, unsigned long mask, int n);
 
 static unsigned long blong (unsigned char *p);
 //static unsigned long llong (unsigned char *p);
 static unsigned long bword (unsigned char *p);
 static unsigned long lword (unsigned char *p);
+static unsigned long long lquad (unsigned char *p);
 
 static unsigned long mirror (unsigned long x, int n);
 
+static void copy_match (unsigned char *out, long posn, long length);
+
+#ifdef BENCH
+/*
+ * While bench_log is set, unpack records each match in it, so that
+ * the benchmark can time the match copies on their own.
+ */
+static struct bench_match {
+    long out, posn, length;
+} *bench_log;
+static long bench_nlog;
+#endif
+
 /*
  * Return an error string corresponding to an error return code.
  */
@@ -203,6 +253,8 @@ char *rnc_error (long errcode) {
 	"File size mismatch",
 	"CRC error in packed data",
 	"CRC error in unpacked data",
+	"Error reading packed data",
+	"Out of memory",
 	"Unknown error"
     };
 
@@ -227,7 +279,8 @@ long rnc_ulen (void *packed) {
 
 /*
  * Decompress a packed data block. Returns the unpacked length if
- * successful, or negative error codes if not.
+ * successful, or negative error codes if not. The unpacked buffer
+ * needs RNC_UNPACK_SLACK bytes of room past the unpacked length.
  *
  * If COMPRESSOR is defined, it also returns the leeway number
  * (which gets stored at offset 16 into the compressed-file header)
@@ -265,8 +318,8 @@ long rnc_unpack (void *packed, void *unpacked
 	return RNC_PACKED_CRC_ERROR;
     out_crc = bword(input-6);
 
-    bitread_init (&bs, &input);
-    bit_advance (&bs, 2, &input);      /* discard first two bits */
+    bitread_init (&bs, input, inputend);
+    bit_advance (&bs, 2);	       /* discard first two bits */
 
     /*
      * Process chunks.
@@ -275,39 +328,53 @@ long rnc_unpack (void *packed, void *unpacked
 #ifdef COMPRESSOR
 	long this_lee;
 #endif
-	read_huftable (&raw, &bs, &input);
-	read_huftable (&dist, &bs, &input);
-	read_huftable (&len, &bs, &input);
-	ch_count = bit_read (&bs, 0xFFFF, 16, &input);
+	read_huftable (&raw, &bs);
+	read_huftable (&dist, &bs);
+	read_huftable (&len, &bs);
+	ch_count = bit_read (&bs, 0xFFFF, 16);
 
 	while (1) {
 	    long length, posn;
 
-	    length = huf_read (&raw, &bs, &input);
+	    length = huf_read (&raw, &bs);
 	    if (length == -1)
 		return RNC_HUF_DECODE_ERROR;
 	    if (length) {
-		while (length--)
-		    *output++ = *input++;
-		bitread_fix (&bs, &input);
+		input = bit_input (&bs);
+		if (length > outputend - output || length > inputend - input)
+		    return RNC_FILE_SIZE_MISMATCH;
+		memcpy (output, input, length);
+		output += length;
+		input += length;
+		bitread_fix (&bs, input);
 	    }
 	    if (--ch_count <= 0)
 		break;
 
-	    posn = huf_read (&dist, &bs, &input);
+	    posn = huf_read (&dist, &bs);
 	    if (posn == -1)
 		return RNC_HUF_DECODE_ERROR;
-	    length = huf_read (&len, &bs, &input);
+	    length = huf_read (&len, &bs);
 	    if (length == -1)
 		return RNC_HUF_DECODE_ERROR;
 	    posn += 1;
 	    length += 2;
-	    while (length--) {
-		*output = output[-posn];
-		output++;
+	    if (length > outputend - output)
+		return RNC_FILE_SIZE_MISMATCH;
+	    if (posn > output - (unsigned char *) unpacked)
+		return RNC_HUF_DECODE_ERROR;
+#ifdef BENCH
+	    if (bench_log) {
+		struct bench_match *m = &bench_log[bench_nlog++];
+		m->out = output - (unsigned char *) unpacked;
+		m->posn = posn;
+		m->length = length;
 	    }
+#endif
+	    copy_match (output, posn, length);
+	    output += length;
 #ifdef COMPRESSOR
-	    this_lee = (inputend - input) - (outputend - output);
+	    this_lee = (inputend - bit_input (&bs)) - (outputend - output);
 	    if (lee < this_lee)
 		lee = this_lee;
 #endif
@@ -331,22 +398,392 @@ long rnc_unpack (void *packed, void *unpacked
     return ret_len;
 }
 
+/*
+ * Streaming decompression. The packed data is pulled in through a
+ * small input buffer with the `read' callback, and decoded into an
+ * output buffer from which the caller takes it in pieces of any
+ * size. Once the output buffer is full and has all been taken, its
+ * last STREAM_WINDOW bytes, which later matches may still refer to,
+ * are moved back to the front and decoding resumes after them.
+ *
+ * Both CRCs are computed as the data goes through, and checked once
+ * the last byte has been decoded.
+ */
+#define STREAM_WINDOW 0x10000	       /* how far back a match can go */
+#define STREAM_OUT_SZ 0x20000	       /* size of the output buffer */
+#define STREAM_IN_SZ 0x8000	       /* size of the input buffer */
+#define STREAM_IN_MIN 128	       /* enough input for any code group */
+
+enum {
+    ST_CHUNK,			       /* next: Huffman tables */
+    ST_TOKEN,			       /* next: literal run length */
+    ST_LITERAL,			       /* copying a literal run */
+    ST_MATCH_HDR,		       /* next: match distance and length */
+    ST_MATCH,			       /* copying a match */
+    ST_DONE
+};
+
+struct rnc_stream {
+    rnc_read_fn *read;
+    void *ctx;
+    long error;			       /* sticky error code, or 0 */
+    int state;
+    unsigned long plen;		       /* packed length from the header */
+    unsigned long in_left;	       /* packed bytes not read in yet */
+    unsigned long out_left;	       /* unpacked bytes not decoded yet */
+    unsigned long produced;	       /* unpacked bytes decoded so far */
+    unsigned in_crc, in_crc_want;
+    unsigned out_crc, out_crc_want;
+    bit_stream bs;
+    huf_table raw, dist, len;
+    unsigned long ch_count;
+    unsigned char *lit;		       /* next literal byte to copy */
+    long left;			       /* bytes left in the run or match */
+    long posn;			       /* distance of the current match */
+    unsigned char *in_end;	       /* end of the buffered input */
+    long out, rd;		       /* decode and read positions */
+    unsigned char in[STREAM_IN_SZ];
+    unsigned char outbuf[STREAM_OUT_SZ + RNC_UNPACK_SLACK];
+};
+
+/*
+ * Move the buffered input from keep on to the front of the input
+ * buffer, and read in as much more as fits. On corrupt data, the bit
+ * reader may have run past the end of the input, so keep is clamped
+ * to it.
+ */
+static long stream_fill (rnc_stream *rs, unsigned char *keep) {
+    long shift, n;
+
+    if (keep > rs->in_end)
+	keep = rs->in_end;
+    shift = keep - rs->in;
+    memmove (rs->in, keep, rs->in_end - keep);
+    rs->in_end -= shift;
+    rs->bs.next -= shift;
+    if (rs->state == ST_LITERAL)
+	rs->lit -= shift;
+    while (rs->in_left && rs->in_end < rs->in + STREAM_IN_SZ) {
+	n = rs->in + STREAM_IN_SZ - rs->in_end;
+	if (n > rs->in_left)
+	    n = rs->in_left;
+	n = rs->read (rs->ctx, rs->in_end, n);
+	if (n < 0)
+	    return RNC_INPUT_ERROR;
+	if (n == 0)
+	    return RNC_FILE_SIZE_MISMATCH;
+	rs->in_crc = rnc_crc_update (rs->in_crc, rs->in_end, n);
+	rs->in_end += n;
+	rs->in_left -= n;
+    }
+    rs->bs.end = rs->in_end;
+    return 0;
+}
+
+/*
+ * Make sure there is enough input buffered after p, unless it has
+ * all been read in already.
+ */
+static long stream_need (rnc_stream *rs, unsigned char *p) {
+    if (rs->in_left && rs->in_end - p < STREAM_IN_MIN)
+	return stream_fill (rs, p);
+    return 0;
+}
+
+/*
+ * Read in what is left of the packed data and check both CRCs. A
+ * packed-data CRC error takes precedence over err, as it is what
+ * the one-shot decoder would have reported.
+ */
+static long stream_check (rnc_stream *rs, long err) {
+    if (err == RNC_INPUT_ERROR)
+	return err;
+    while (rs->in_left) {
+	long fill_err = stream_fill (rs, rs->in_end);
+	if (fill_err)
+	    return fill_err;
+    }
+    if (rs->in_crc != rs->in_crc_want)
+	return RNC_PACKED_CRC_ERROR;
+    if (!err && rs->out_crc != rs->out_crc_want)
+	return RNC_UNPACKED_CRC_ERROR;
+    return err;
+}
+
+/*
+ * Decode until the output buffer is full or the data runs out.
+ */
+static void stream_decode (rnc_stream *rs) {
+    unsigned char *start = rs->outbuf + rs->out;
+    unsigned char *outend = rs->outbuf + STREAM_OUT_SZ;
+    unsigned char *out = start;
+    long err = 0;
+    long n;
+
+    while (!err && out < outend && rs->state != ST_DONE) {
+	switch (rs->state) {
+	  case ST_CHUNK:
+	    if (!rs->out_left) {
+		rs->state = ST_DONE;
+		break;
+	    }
+	    if ((err = stream_need (rs, bit_input (&rs->bs))))
+		break;
+	    read_huftable (&rs->raw, &rs->bs);
+	    read_huftable (&rs->dist, &rs->bs);
+	    read_huftable (&rs->len, &rs->bs);
+	    rs->ch_count = bit_read (&rs->bs, 0xFFFF, 16);
+	    rs->state = ST_TOKEN;
+	    break;
+
+	  case ST_TOKEN:
+	    if ((err = stream_need (rs, bit_input (&rs->bs))))
+		break;
+	    n = huf_read (&rs->raw, &rs->bs);
+	    if (n == -1) {
+		err = RNC_HUF_DECODE_ERROR;
+		break;
+	    }
+	    if (n > rs->out_left) {
+		err = RNC_FILE_SIZE_MISMATCH;
+		break;
+	    }
+	    if (n) {
+		rs->lit = bit_input (&rs->bs);
+		rs->left = n;
+		rs->state = ST_LITERAL;
+	    } else
+		rs->state = ST_MATCH_HDR;
+	    break;
+
+	  case ST_LITERAL:
+	    if ((err = stream_need (rs, rs->lit)))
+		break;
+	    if (rs->lit > rs->in_end) {
+		err = RNC_FILE_SIZE_MISMATCH;
+		break;
+	    }
+	    n = rs->left;
+	    if (n > outend - out)
+		n = outend - out;
+	    if (n > rs->in_end - rs->lit)
+		n = rs->in_end - rs->lit;
+	    if (n <= 0) {
+		err = RNC_FILE_SIZE_MISMATCH;
+		break;
+	    }
+	    memcpy (out, rs->lit, n);
+	    out += n;
+	    rs->lit += n;
+	    rs->left -= n;
+	    rs->out_left -= n;
+	    if (rs->left)
+		break;
+	    if ((err = stream_need (rs, rs->lit)))
+		break;
+	    bitread_fix (&rs->bs, rs->lit);
+	    rs->state = ST_MATCH_HDR;
+	    break;
+
+	  case ST_MATCH_HDR:
+	    if (--rs->ch_count == 0) {
+		rs->state = ST_CHUNK;
+		break;
+	    }
+	    if ((err = stream_need (rs, bit_input (&rs->bs))))
+		break;
+	    rs->posn = huf_read (&rs->dist, &rs->bs);
+	    n = huf_read (&rs->len, &rs->bs);
+	    if (rs->posn == -1 || n == -1) {
+		err = RNC_HUF_DECODE_ERROR;
+		break;
+	    }
+	    rs->posn += 1;
+	    rs->left = n + 2;
+	    if (rs->left > rs->out_left) {
+		err = RNC_FILE_SIZE_MISMATCH;
+		break;
+	    }
+	    if (rs->posn > STREAM_WINDOW
+		|| rs->posn > rs->produced + (out - start)) {
+		err = RNC_HUF_DECODE_ERROR;
+		break;
+	    }
+	    rs->state = ST_MATCH;
+	    break;
+
+	  case ST_MATCH:
+	    n = rs->left;
+	    if (n > outend - out)
+		n = outend - out;
+	    copy_match (out, rs->posn, n);
+	    out += n;
+	    rs->left -= n;
+	    rs->out_left -= n;
+	    if (!rs->left)
+		rs->state = ST_TOKEN;
+	    break;
+	}
+    }
+
+    rs->out_crc = rnc_crc_update (rs->out_crc, start, out - start);
+    rs->produced += out - start;
+    rs->out = out - rs->outbuf;
+    if (err || rs->state == ST_DONE)
+	rs->error = stream_check (rs, err);
+}
+
+/*
+ * Start decompressing a packed data block, read through `read'.
+ * Returns the unpacked length, having set `*rs' to a new stream, or
+ * a negative error code.
+ */
+long rnc_open (rnc_stream **rsp, rnc_read_fn *read, void *ctx) {
+    unsigned char hdr[18];
+    rnc_stream *rs;
+    long got, n, err;
+
+    *rsp = NULL;
+    for (got = 0; got < sizeof hdr; got += n) {
+	n = read (ctx, hdr + got, sizeof hdr - got);
+	if (n < 0)
+	    return RNC_INPUT_ERROR;
+	if (n == 0)
+	    return RNC_FILE_IS_NOT_RNC;
+    }
+    if (blong (hdr) != RNC_SIGNATURE)
+	return RNC_FILE_IS_NOT_RNC;
+
+    rs = malloc (sizeof *rs);
+    if (!rs)
+	return RNC_OUT_OF_MEMORY;
+    rs->read = read;
+    rs->ctx = ctx;
+    rs->error = 0;
+    rs->state = ST_CHUNK;
+    rs->out_left = blong (hdr+4);
+    rs->plen = rs->in_left = blong (hdr+8);
+    rs->produced = 0;
+    rs->in_crc = rs->out_crc = 0;
+    rs->out_crc_want = bword (hdr+12);
+    rs->in_crc_want = bword (hdr+14);
+    rs->bs.next = rs->lit = rs->in_end = rs->in;
+    rs->out = rs->rd = 0;
+
+    err = stream_fill (rs, rs->in);
+    if (err) {
+	free (rs);
+	return err;
+    }
+    bitread_init (&rs->bs, rs->in, rs->in_end);
+    bit_advance (&rs->bs, 2);	       /* discard first two bits */
+
+    *rsp = rs;
+    return rs->out_left;
+}
+
+/*
+ * Return the packed length of the data block being decompressed.
+ */
+long rnc_packed_len (rnc_stream *rs) {
+    return rs->plen;
+}
+
+/*
+ * Return how many decoded bytes are available, setting `*buf' to
+ * them, or a negative error code. Only returns 0 at the end of the
+ * data. The bytes stay there until rnc_skip or rnc_read is called.
+ */
+long rnc_peek (rnc_stream *rs, void **buf) {
+    if (rs->rd == rs->out && rs->state != ST_DONE && !rs->error) {
+	if (rs->out == STREAM_OUT_SZ) {
+	    memmove (rs->outbuf, rs->outbuf + STREAM_OUT_SZ - STREAM_WINDOW,
+		     STREAM_WINDOW);
+	    rs->out = rs->rd = STREAM_WINDOW;
+	}
+	stream_decode (rs);
+    }
+    if (rs->error)
+	return rs->error;
+    *buf = rs->outbuf + rs->rd;
+    return rs->out - rs->rd;
+}
+
+/*
+ * Skip up to len decoded bytes. Returns how many were skipped, which
+ * is less than len only at the end of the data, or a negative error
+ * code.
+ */
+long rnc_skip (rnc_stream *rs, long len) {
+    long done = 0;
+    void *buf;
+
+    while (done < len) {
+	long n = rnc_peek (rs, &buf);
+	if (n < 0)
+	    return n;
+	if (n == 0)
+	    break;
+	if (n > len - done)
+	    n = len - done;
+	rs->rd += n;
+	done += n;
+    }
+    return done;
+}
+
+/*
+ * Read up to len decoded bytes into buf, returning the same as
+ * rnc_skip.
+ */
+long rnc_read (rnc_stream *rs, void *buf, long len) {
+    unsigned char *p = buf;
+    long done = 0;
+    void *avail = NULL;
+
+    while (done < len) {
+	long n = rnc_peek (rs, &avail);
+	if (n < 0)
+	    return n;
+	if (n == 0)
+	    break;
+	if (n > len - done)
+	    n = len - done;
+	memcpy (p + done, avail, n);
+	rs->rd += n;
+	done += n;
+    }
+    return done;
+}
+
+/*
+ * Free a stream returned by rnc_open.
+ */
+void rnc_close (rnc_stream *rs) {
+    free (rs);
+}
+
 /*
  * Read a Huffman table out of the bit stream and data stream given.
  */
-static void read_huftable (huf_table *h, bit_stream *bs, unsigned char **p) {
+static void read_huftable (huf_table *h, bit_stream *bs) {
     int i, j, k, num;
     int leaflen[32];
     int leafmax;
     unsigned long codeb;	       /* big-endian form of code */
 
-    num = bit_read (bs, 0x1F, 5, p);
-    if (!num)
+    for (i=0; i < (1 << HUF_LOOKUP_BITS); i++)
+	h->lookup[i] = -1;
+
+    num = bit_read (bs, 0x1F, 5);
+    if (!num) {
+	h->num = 0;
 	return;
+    }
 
     leafmax = 1;
     for (i=0; i<num; i++) {
-	leaflen[i] = bit_read (bs, 0x0F, 4, p);
+	leaflen[i] = bit_read (bs, 0x0F, 4);
 	if (leafmax < leaflen[i])
 	    leafmax = leaflen[i];
     }
@@ -366,52 +803,116 @@ static void read_huftable (huf_table *h, bit_stream *bs, unsigned char **p) {
     }
 
     h->num = k;
+
+    /*
+     * Fill the lookup table backwards, so that the first matching
+     * code wins as it does in the linear search. Codes whose bits
+     * overflow their length never match and are left out.
+     */
+    for (k=h->num-1; k>=0; k--) {
+	int codelen = h->table[k].codelen;
+	unsigned long code = h->table[k].code;
+	if (codelen > HUF_LOOKUP_BITS || code >> codelen)
+	    continue;
+	for (j=0; j < (1 << (HUF_LOOKUP_BITS - codelen)); j++)
+	    h->lookup[code | ((unsigned long)j << codelen)] = k;
+    }
 }
 
 /*
  * Read a value out of the bit stream using the given Huffman table.
  */
-static unsigned long huf_read (huf_table *h, bit_stream *bs,
-			       unsigned char **p) {
-    int i;
+static unsigned long huf_read (huf_table *h, bit_stream *bs) {
+    int i, codelen, n;
     unsigned long val;
 
-    for (i=0; i<h->num; i++) {
-	unsigned long mask = (1 << h->table[i].codelen) - 1;
-	if (bit_peek(bs, mask) == h->table[i].code)
-	    break;
+    i = h->lookup[bit_peek (bs, (1 << HUF_LOOKUP_BITS) - 1)];
+    if (i < 0) {
+	for (i=0; i<h->num; i++) {
+	    unsigned long mask = (1 << h->table[i].codelen) - 1;
+	    if (bit_peek(bs, mask) == h->table[i].code)
+		break;
+	}
+	if (i == h->num)
+	    return -1;
     }
-    if (i == h->num)
-	return -1;
-    bit_advance (bs, h->table[i].codelen, p);
-
+    codelen = h->table[i].codelen;
     val = h->table[i].value;
+    n = val - 1;
+
+    if (val >= 2 && codelen + n <= 32) {
+	val = (1UL << n) | ((bs->bitbuf >> codelen) & ((1UL << n) - 1));
+	bit_advance (bs, codelen + n);
+	return val;
+    }
+    bit_advance (bs, codelen);
 
     if (val >= 2) {
 	val = 1 << (val-1);
-	val |= bit_read (bs, val-1, h->table[i].value - 1, p);
+	val |= bit_read (bs, val-1, h->table[i].value - 1);
     }
     return val;
 }
 
 /*
- * Initialises a bit stream with the first two bytes of the packed
- * data.
+ * Initialises a bit stream with the packed data from p to end.
  */
-static void bitread_init (bit_stream *bs, unsigned char **p) {
-    bs->bitbuf = lword (*p);
-    bs->bitcount = 16;
+static void bitread_init (bit_stream *bs, unsigned char *p,
+			  unsigned char *end) {
+    bs->bitbuf = 0;
+    bs->bitcount = 0;
+    bs->next = p;
+    bs->end = end;
+    bit_refill (bs);
 }
 
 /*
  * Fixes up a bit stream after literals have been read out of the
- * data stream.
+ * data stream, up to p. The whole words loaded from where the
+ * literals started are dropped, leaving the part-read word below
+ * them, and loading resumes at p.
  */
-static void bitread_fix (bit_stream *bs, unsigned char **p) {
-    bs->bitcount -= 16;
-    bs->bitbuf &= (1<<bs->bitcount)-1; /* remove the top 16 bits */
-    bs->bitbuf |= (lword(*p)<<bs->bitcount);/* replace with what's at *p */
-    bs->bitcount += 16;
+static void bitread_fix (bit_stream *bs, unsigned char *p) {
+    bs->bitcount &= 15;
+    bs->bitbuf &= (1ULL<<bs->bitcount)-1;
+    bs->next = p;
+    bit_refill (bs);
+}
+
+/*
+ * Tops the bit buffer up to at least 32 bits. Away from the end of
+ * the input, as many whole words as fit (two or three) are taken
+ * from a single load; near it, they are loaded one at a time, with
+ * anything past the end reading as zero.
+ */
+static void bit_refill (bit_stream *bs) {
+    if (bs->end - bs->next >= 8) {
+	int n = (63 - bs->bitcount) >> 4;
+	unsigned long long mask = (1ULL << 16*n) - 1;
+	bs->bitbuf |= (lquad(bs->next) & mask) << bs->bitcount;
+	bs->next += 2*n;
+	bs->bitcount += 16*n;
+	return;
+    }
+    while (bs->bitcount < 32) {
+	unsigned long word = 0;
+	if (bs->end - bs->next >= 2)
+	    word = lword (bs->next);
+	else if (bs->end - bs->next == 1)
+	    word = bs->next[0];
+	bs->bitbuf |= (unsigned long long)word << bs->bitcount;
+	bs->next += 2;
+	bs->bitcount += 16;
+    }
+}
+
+/*
+ * Returns where the literals start in the data stream: just past the
+ * word that is part-read, ie below the whole words in the buffer.
+ * This is where a reader loading one word at a time would be.
+ */
+static unsigned char *bit_input (bit_stream *bs) {
+    return bs->next - 2*(bs->bitcount >> 4);
 }
 
 /*
@@ -424,23 +925,19 @@ static unsigned long bit_peek (bit_stream *bs, unsigned long mask) {
 /*
  * Advances the bit stream.
  */
-static void bit_advance (bit_stream *bs, int n, unsigned char **p) {
+static void bit_advance (bit_stream *bs, int n) {
     bs->bitbuf >>= n;
     bs->bitcount -= n;
-    if (bs->bitcount < 16) {
-	(*p) += 2;
-	bs->bitbuf |= (lword(*p)<<bs->bitcount);
-	bs->bitcount += 16;
-    }
+    if (bs->bitcount < 32)
+	bit_refill (bs);
 }
 
 /*
  * Reads some bits in one go (ie the above two routines combined).
  */
-static unsigned long bit_read (bit_stream *bs, unsigned long mask,
-			       int n, unsigned char **p) {
+static unsigned long bit_read (bit_stream *bs, unsigned long mask, int n) {
     unsigned long result = bit_peek (bs, mask);
-    bit_advance (bs, n, p);
+    bit_advance (bs, n);
     return result;
 }
 
@@ -488,6 +985,18 @@ static unsigned long lword (unsigned char *p) {
     return n;
 }
 
+/*
+ * Return the little-endian quadword at p.
+ */
+static unsigned long long lquad (unsigned char *p) {
+    unsigned long long n;
+    int i;
+    n = 0;
+    for (i=7; i>=0; i--)
+	n = (n << 8) | p[i];
+    return n;
+}
+
 /*
  * Mirror the bottom n bits of x.
  */
@@ -505,34 +1014,715 @@ static unsigned long mirror (unsigned long x, int n) {
 }
 
 /*
- * Calculate a CRC, the RNC way. It re-computes its CRC table every
- * time it's run, but who cares? ;-)
+ * Copy `length' bytes from `posn' bytes back. Distant matches are
+ * copied 16 or 8 bytes at a time, and short repeats are filled in
+ * from an 8-byte pattern, so up to RNC_UNPACK_SLACK-1 bytes past
+ * the match may be overwritten too.
  */
-long rnc_crc (void *data, long len) {
-    unsigned short crctab[256];
-    unsigned short val;
-    int i, j;
-    unsigned char *p = data;
+static void copy_match (unsigned char *out, long posn, long length) {
+    unsigned char *end = out + length;
+    unsigned char *from = out - posn;
 
-    for (i=0; i<256; i++) {
-	val = i;
+    if (posn >= 16) {
+	do {
+	    memcpy (out, from, 16);
+	    out += 16;
+	    from += 16;
+	} while (out < end);
+    } else if (posn >= 8) {
+	do {
+	    memcpy (out, from, 8);
+	    out += 8;
+	    from += 8;
+	} while (out < end);
+    } else if (posn == 1) {
+	memset (out, out[-1], length);
+    } else {
+	unsigned char pat[8];
+	int i, step = 8 - 8 % posn;   /* whole repeats in the pattern */
+	for (i=0; i<8; i++)
+	    pat[i] = from[i % posn];
+	do {
+	    memcpy (out, pat, 8);
+	    out += step;
+	} while (out < end);
+    }
+}
 
-	for (j=0; j<8; j++) {
-	    if (val & 1)
-		val = (val >> 1) ^ 0xA001;
-	    else
-		val = (val >> 1);
-	}
-	crctab[i] = val;
+/*
+ * The CRC tables. crctab[0] is the classic byte-at-a-time table, the
+ * CRC of byte i with the polynomial 0xA001; crctab[k][i] is the CRC
+ * of byte i followed by k zero bytes, which lets eight bytes be
+ * folded in at once (slicing-by-8).
+ */
+static const unsigned short crctab[8][256] = {
+    {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+    },
+    {
+	0x0000, 0x9001, 0x6001, 0xF000, 0xC002, 0x5003, 0xA003, 0x3002,
+	0xC007, 0x5006, 0xA006, 0x3007, 0x0005, 0x9004, 0x6004, 0xF005,
+	0xC00D, 0x500C, 0xA00C, 0x300D, 0x000F, 0x900E, 0x600E, 0xF00F,
+	0x000A, 0x900B, 0x600B, 0xF00A, 0xC008, 0x5009, 0xA009, 0x3008,
+	0xC019, 0x5018, 0xA018, 0x3019, 0x001B, 0x901A, 0x601A, 0xF01B,
+	0x001E, 0x901F, 0x601F, 0xF01E, 0xC01C, 0x501D, 0xA01D, 0x301C,
+	0x0014, 0x9015, 0x6015, 0xF014, 0xC016, 0x5017, 0xA017, 0x3016,
+	0xC013, 0x5012, 0xA012, 0x3013, 0x0011, 0x9010, 0x6010, 0xF011,
+	0xC031, 0x5030, 0xA030, 0x3031, 0x0033, 0x9032, 0x6032, 0xF033,
+	0x0036, 0x9037, 0x6037, 0xF036, 0xC034, 0x5035, 0xA035, 0x3034,
+	0x003C, 0x903D, 0x603D, 0xF03C, 0xC03E, 0x503F, 0xA03F, 0x303E,
+	0xC03B, 0x503A, 0xA03A, 0x303B, 0x0039, 0x9038, 0x6038, 0xF039,
+	0x0028, 0x9029, 0x6029, 0xF028, 0xC02A, 0x502B, 0xA02B, 0x302A,
+	0xC02F, 0x502E, 0xA02E, 0x302F, 0x002D, 0x902C, 0x602C, 0xF02D,
+	0xC025, 0x5024, 0xA024, 0x3025, 0x0027, 0x9026, 0x6026, 0xF027,
+	0x0022, 0x9023, 0x6023, 0xF022, 0xC020, 0x5021, 0xA021, 0x3020,
+	0xC061, 0x5060, 0xA060, 0x3061, 0x0063, 0x9062, 0x6062, 0xF063,
+	0x0066, 0x9067, 0x6067, 0xF066, 0xC064, 0x5065, 0xA065, 0x3064,
+	0x006C, 0x906D, 0x606D, 0xF06C, 0xC06E, 0x506F, 0xA06F, 0x306E,
+	0xC06B, 0x506A, 0xA06A, 0x306B, 0x0069, 0x9068, 0x6068, 0xF069,
+	0x0078, 0x9079, 0x6079, 0xF078, 0xC07A, 0x507B, 0xA07B, 0x307A,
+	0xC07F, 0x507E, 0xA07E, 0x307F, 0x007D, 0x907C, 0x607C, 0xF07D,
+	0xC075, 0x5074, 0xA074, 0x3075, 0x0077, 0x9076, 0x6076, 0xF077,
+	0x0072, 0x9073, 0x6073, 0xF072, 0xC070, 0x5071, 0xA071, 0x3070,
+	0x0050, 0x9051, 0x6051, 0xF050, 0xC052, 0x5053, 0xA053, 0x3052,
+	0xC057, 0x5056, 0xA056, 0x3057, 0x0055, 0x9054, 0x6054, 0xF055,
+	0xC05D, 0x505C, 0xA05C, 0x305D, 0x005F, 0x905E, 0x605E, 0xF05F,
+	0x005A, 0x905B, 0x605B, 0xF05A, 0xC058, 0x5059, 0xA059, 0x3058,
+	0xC049, 0x5048, 0xA048, 0x3049, 0x004B, 0x904A, 0x604A, 0xF04B,
+	0x004E, 0x904F, 0x604F, 0xF04E, 0xC04C, 0x504D, 0xA04D, 0x304C,
+	0x0044, 0x9045, 0x6045, 0xF044, 0xC046, 0x5047, 0xA047, 0x3046,
+	0xC043, 0x5042, 0xA042, 0x3043, 0x0041, 0x9040, 0x6040, 0xF041
+    },
+    {
+	0x0000, 0xC051, 0xC0A1, 0x00F0, 0xC141, 0x0110, 0x01E0, 0xC1B1,
+	0xC281, 0x02D0, 0x0220, 0xC271, 0x03C0, 0xC391, 0xC361, 0x0330,
+	0xC501, 0x0550, 0x05A0, 0xC5F1, 0x0440, 0xC411, 0xC4E1, 0x04B0,
+	0x0780, 0xC7D1, 0xC721, 0x0770, 0xC6C1, 0x0690, 0x0660, 0xC631,
+	0xCA01, 0x0A50, 0x0AA0, 0xCAF1, 0x0B40, 0xCB11, 0xCBE1, 0x0BB0,
+	0x0880, 0xC8D1, 0xC821, 0x0870, 0xC9C1, 0x0990, 0x0960, 0xC931,
+	0x0F00, 0xCF51, 0xCFA1, 0x0FF0, 0xCE41, 0x0E10, 0x0EE0, 0xCEB1,
+	0xCD81, 0x0DD0, 0x0D20, 0xCD71, 0x0CC0, 0xCC91, 0xCC61, 0x0C30,
+	0xD401, 0x1450, 0x14A0, 0xD4F1, 0x1540, 0xD511, 0xD5E1, 0x15B0,
+	0x1680, 0xD6D1, 0xD621, 0x1670, 0xD7C1, 0x1790, 0x1760, 0xD731,
+	0x1100, 0xD151, 0xD1A1, 0x11F0, 0xD041, 0x1010, 0x10E0, 0xD0B1,
+	0xD381, 0x13D0, 0x1320, 0xD371, 0x12C0, 0xD291, 0xD261, 0x1230,
+	0x1E00, 0xDE51, 0xDEA1, 0x1EF0, 0xDF41, 0x1F10, 0x1FE0, 0xDFB1,
+	0xDC81, 0x1CD0, 0x1C20, 0xDC71, 0x1DC0, 0xDD91, 0xDD61, 0x1D30,
+	0xDB01, 0x1B50, 0x1BA0, 0xDBF1, 0x1A40, 0xDA11, 0xDAE1, 0x1AB0,
+	0x1980, 0xD9D1, 0xD921, 0x1970, 0xD8C1, 0x1890, 0x1860, 0xD831,
+	0xE801, 0x2850, 0x28A0, 0xE8F1, 0x2940, 0xE911, 0xE9E1, 0x29B0,
+	0x2A80, 0xEAD1, 0xEA21, 0x2A70, 0xEBC1, 0x2B90, 0x2B60, 0xEB31,
+	0x2D00, 0xED51, 0xEDA1, 0x2DF0, 0xEC41, 0x2C10, 0x2CE0, 0xECB1,
+	0xEF81, 0x2FD0, 0x2F20, 0xEF71, 0x2EC0, 0xEE91, 0xEE61, 0x2E30,
+	0x2200, 0xE251, 0xE2A1, 0x22F0, 0xE341, 0x2310, 0x23E0, 0xE3B1,
+	0xE081, 0x20D0, 0x2020, 0xE071, 0x21C0, 0xE191, 0xE161, 0x2130,
+	0xE701, 0x2750, 0x27A0, 0xE7F1, 0x2640, 0xE611, 0xE6E1, 0x26B0,
+	0x2580, 0xE5D1, 0xE521, 0x2570, 0xE4C1, 0x2490, 0x2460, 0xE431,
+	0x3C00, 0xFC51, 0xFCA1, 0x3CF0, 0xFD41, 0x3D10, 0x3DE0, 0xFDB1,
+	0xFE81, 0x3ED0, 0x3E20, 0xFE71, 0x3FC0, 0xFF91, 0xFF61, 0x3F30,
+	0xF901, 0x3950, 0x39A0, 0xF9F1, 0x3840, 0xF811, 0xF8E1, 0x38B0,
+	0x3B80, 0xFBD1, 0xFB21, 0x3B70, 0xFAC1, 0x3A90, 0x3A60, 0xFA31,
+	0xF601, 0x3650, 0x36A0, 0xF6F1, 0x3740, 0xF711, 0xF7E1, 0x37B0,
+	0x3480, 0xF4D1, 0xF421, 0x3470, 0xF5C1, 0x3590, 0x3560, 0xF531,
+	0x3300, 0xF351, 0xF3A1, 0x33F0, 0xF241, 0x3210, 0x32E0, 0xF2B1,
+	0xF181, 0x31D0, 0x3120, 0xF171, 0x30C0, 0xF091, 0xF061, 0x3030
+    },
+    {
+	0x0000, 0xFC01, 0xB801, 0x4400, 0x3001, 0xCC00, 0x8800, 0x7401,
+	0x6002, 0x9C03, 0xD803, 0x2402, 0x5003, 0xAC02, 0xE802, 0x1403,
+	0xC004, 0x3C05, 0x7805, 0x8404, 0xF005, 0x0C04, 0x4804, 0xB405,
+	0xA006, 0x5C07, 0x1807, 0xE406, 0x9007, 0x6C06, 0x2806, 0xD407,
+	0xC00B, 0x3C0A, 0x780A, 0x840B, 0xF00A, 0x0C0B, 0x480B, 0xB40A,
+	0xA009, 0x5C08, 0x1808, 0xE409, 0x9008, 0x6C09, 0x2809, 0xD408,
+	0x000F, 0xFC0E, 0xB80E, 0x440F, 0x300E, 0xCC0F, 0x880F, 0x740E,
+	0x600D, 0x9C0C, 0xD80C, 0x240D, 0x500C, 0xAC0D, 0xE80D, 0x140C,
+	0xC015, 0x3C14, 0x7814, 0x8415, 0xF014, 0x0C15, 0x4815, 0xB414,
+	0xA017, 0x5C16, 0x1816, 0xE417, 0x9016, 0x6C17, 0x2817, 0xD416,
+	0x0011, 0xFC10, 0xB810, 0x4411, 0x3010, 0xCC11, 0x8811, 0x7410,
+	0x6013, 0x9C12, 0xD812, 0x2413, 0x5012, 0xAC13, 0xE813, 0x1412,
+	0x001E, 0xFC1F, 0xB81F, 0x441E, 0x301F, 0xCC1E, 0x881E, 0x741F,
+	0x601C, 0x9C1D, 0xD81D, 0x241C, 0x501D, 0xAC1C, 0xE81C, 0x141D,
+	0xC01A, 0x3C1B, 0x781B, 0x841A, 0xF01B, 0x0C1A, 0x481A, 0xB41B,
+	0xA018, 0x5C19, 0x1819, 0xE418, 0x9019, 0x6C18, 0x2818, 0xD419,
+	0xC029, 0x3C28, 0x7828, 0x8429, 0xF028, 0x0C29, 0x4829, 0xB428,
+	0xA02B, 0x5C2A, 0x182A, 0xE42B, 0x902A, 0x6C2B, 0x282B, 0xD42A,
+	0x002D, 0xFC2C, 0xB82C, 0x442D, 0x302C, 0xCC2D, 0x882D, 0x742C,
+	0x602F, 0x9C2E, 0xD82E, 0x242F, 0x502E, 0xAC2F, 0xE82F, 0x142E,
+	0x0022, 0xFC23, 0xB823, 0x4422, 0x3023, 0xCC22, 0x8822, 0x7423,
+	0x6020, 0x9C21, 0xD821, 0x2420, 0x5021, 0xAC20, 0xE820, 0x1421,
+	0xC026, 0x3C27, 0x7827, 0x8426, 0xF027, 0x0C26, 0x4826, 0xB427,
+	0xA024, 0x5C25, 0x1825, 0xE424, 0x9025, 0x6C24, 0x2824, 0xD425,
+	0x003C, 0xFC3D, 0xB83D, 0x443C, 0x303D, 0xCC3C, 0x883C, 0x743D,
+	0x603E, 0x9C3F, 0xD83F, 0x243E, 0x503F, 0xAC3E, 0xE83E, 0x143F,
+	0xC038, 0x3C39, 0x7839, 0x8438, 0xF039, 0x0C38, 0x4838, 0xB439,
+	0xA03A, 0x5C3B, 0x183B, 0xE43A, 0x903B, 0x6C3A, 0x283A, 0xD43B,
+	0xC037, 0x3C36, 0x7836, 0x8437, 0xF036, 0x0C37, 0x4837, 0xB436,
+	0xA035, 0x5C34, 0x1834, 0xE435, 0x9034, 0x6C35, 0x2835, 0xD434,
+	0x0033, 0xFC32, 0xB832, 0x4433, 0x3032, 0xCC33, 0x8833, 0x7432,
+	0x6031, 0x9C30, 0xD830, 0x2431, 0x5030, 0xAC31, 0xE831, 0x1430
+    },
+    {
+	0x0000, 0xC03D, 0xC079, 0x0044, 0xC0F1, 0x00CC, 0x0088, 0xC0B5,
+	0xC1E1, 0x01DC, 0x0198, 0xC1A5, 0x0110, 0xC12D, 0xC169, 0x0154,
+	0xC3C1, 0x03FC, 0x03B8, 0xC385, 0x0330, 0xC30D, 0xC349, 0x0374,
+	0x0220, 0xC21D, 0xC259, 0x0264, 0xC2D1, 0x02EC, 0x02A8, 0xC295,
+	0xC781, 0x07BC, 0x07F8, 0xC7C5, 0x0770, 0xC74D, 0xC709, 0x0734,
+	0x0660, 0xC65D, 0xC619, 0x0624, 0xC691, 0x06AC, 0x06E8, 0xC6D5,
+	0x0440, 0xC47D, 0xC439, 0x0404, 0xC4B1, 0x048C, 0x04C8, 0xC4F5,
+	0xC5A1, 0x059C, 0x05D8, 0xC5E5, 0x0550, 0xC56D, 0xC529, 0x0514,
+	0xCF01, 0x0F3C, 0x0F78, 0xCF45, 0x0FF0, 0xCFCD, 0xCF89, 0x0FB4,
+	0x0EE0, 0xCEDD, 0xCE99, 0x0EA4, 0xCE11, 0x0E2C, 0x0E68, 0xCE55,
+	0x0CC0, 0xCCFD, 0xCCB9, 0x0C84, 0xCC31, 0x0C0C, 0x0C48, 0xCC75,
+	0xCD21, 0x0D1C, 0x0D58, 0xCD65, 0x0DD0, 0xCDED, 0xCDA9, 0x0D94,
+	0x0880, 0xC8BD, 0xC8F9, 0x08C4, 0xC871, 0x084C, 0x0808, 0xC835,
+	0xC961, 0x095C, 0x0918, 0xC925, 0x0990, 0xC9AD, 0xC9E9, 0x09D4,
+	0xCB41, 0x0B7C, 0x0B38, 0xCB05, 0x0BB0, 0xCB8D, 0xCBC9, 0x0BF4,
+	0x0AA0, 0xCA9D, 0xCAD9, 0x0AE4, 0xCA51, 0x0A6C, 0x0A28, 0xCA15,
+	0xDE01, 0x1E3C, 0x1E78, 0xDE45, 0x1EF0, 0xDECD, 0xDE89, 0x1EB4,
+	0x1FE0, 0xDFDD, 0xDF99, 0x1FA4, 0xDF11, 0x1F2C, 0x1F68, 0xDF55,
+	0x1DC0, 0xDDFD, 0xDDB9, 0x1D84, 0xDD31, 0x1D0C, 0x1D48, 0xDD75,
+	0xDC21, 0x1C1C, 0x1C58, 0xDC65, 0x1CD0, 0xDCED, 0xDCA9, 0x1C94,
+	0x1980, 0xD9BD, 0xD9F9, 0x19C4, 0xD971, 0x194C, 0x1908, 0xD935,
+	0xD861, 0x185C, 0x1818, 0xD825, 0x1890, 0xD8AD, 0xD8E9, 0x18D4,
+	0xDA41, 0x1A7C, 0x1A38, 0xDA05, 0x1AB0, 0xDA8D, 0xDAC9, 0x1AF4,
+	0x1BA0, 0xDB9D, 0xDBD9, 0x1BE4, 0xDB51, 0x1B6C, 0x1B28, 0xDB15,
+	0x1100, 0xD13D, 0xD179, 0x1144, 0xD1F1, 0x11CC, 0x1188, 0xD1B5,
+	0xD0E1, 0x10DC, 0x1098, 0xD0A5, 0x1010, 0xD02D, 0xD069, 0x1054,
+	0xD2C1, 0x12FC, 0x12B8, 0xD285, 0x1230, 0xD20D, 0xD249, 0x1274,
+	0x1320, 0xD31D, 0xD359, 0x1364, 0xD3D1, 0x13EC, 0x13A8, 0xD395,
+	0xD681, 0x16BC, 0x16F8, 0xD6C5, 0x1670, 0xD64D, 0xD609, 0x1634,
+	0x1760, 0xD75D, 0xD719, 0x1724, 0xD791, 0x17AC, 0x17E8, 0xD7D5,
+	0x1540, 0xD57D, 0xD539, 0x1504, 0xD5B1, 0x158C, 0x15C8, 0xD5F5,
+	0xD4A1, 0x149C, 0x14D8, 0xD4E5, 0x1450, 0xD46D, 0xD429, 0x1414
+    },
+    {
+	0x0000, 0xD101, 0xE201, 0x3300, 0x8401, 0x5500, 0x6600, 0xB701,
+	0x4801, 0x9900, 0xAA00, 0x7B01, 0xCC00, 0x1D01, 0x2E01, 0xFF00,
+	0x9002, 0x4103, 0x7203, 0xA302, 0x1403, 0xC502, 0xF602, 0x2703,
+	0xD803, 0x0902, 0x3A02, 0xEB03, 0x5C02, 0x8D03, 0xBE03, 0x6F02,
+	0x6007, 0xB106, 0x8206, 0x5307, 0xE406, 0x3507, 0x0607, 0xD706,
+	0x2806, 0xF907, 0xCA07, 0x1B06, 0xAC07, 0x7D06, 0x4E06, 0x9F07,
+	0xF005, 0x2104, 0x1204, 0xC305, 0x7404, 0xA505, 0x9605, 0x4704,
+	0xB804, 0x6905, 0x5A05, 0x8B04, 0x3C05, 0xED04, 0xDE04, 0x0F05,
+	0xC00E, 0x110F, 0x220F, 0xF30E, 0x440F, 0x950E, 0xA60E, 0x770F,
+	0x880F, 0x590E, 0x6A0E, 0xBB0F, 0x0C0E, 0xDD0F, 0xEE0F, 0x3F0E,
+	0x500C, 0x810D, 0xB20D, 0x630C, 0xD40D, 0x050C, 0x360C, 0xE70D,
+	0x180D, 0xC90C, 0xFA0C, 0x2B0D, 0x9C0C, 0x4D0D, 0x7E0D, 0xAF0C,
+	0xA009, 0x7108, 0x4208, 0x9309, 0x2408, 0xF509, 0xC609, 0x1708,
+	0xE808, 0x3909, 0x0A09, 0xDB08, 0x6C09, 0xBD08, 0x8E08, 0x5F09,
+	0x300B, 0xE10A, 0xD20A, 0x030B, 0xB40A, 0x650B, 0x560B, 0x870A,
+	0x780A, 0xA90B, 0x9A0B, 0x4B0A, 0xFC0B, 0x2D0A, 0x1E0A, 0xCF0B,
+	0xC01F, 0x111E, 0x221E, 0xF31F, 0x441E, 0x951F, 0xA61F, 0x771E,
+	0x881E, 0x591F, 0x6A1F, 0xBB1E, 0x0C1F, 0xDD1E, 0xEE1E, 0x3F1F,
+	0x501D, 0x811C, 0xB21C, 0x631D, 0xD41C, 0x051D, 0x361D, 0xE71C,
+	0x181C, 0xC91D, 0xFA1D, 0x2B1C, 0x9C1D, 0x4D1C, 0x7E1C, 0xAF1D,
+	0xA018, 0x7119, 0x4219, 0x9318, 0x2419, 0xF518, 0xC618, 0x1719,
+	0xE819, 0x3918, 0x0A18, 0xDB19, 0x6C18, 0xBD19, 0x8E19, 0x5F18,
+	0x301A, 0xE11B, 0xD21B, 0x031A, 0xB41B, 0x651A, 0x561A, 0x871B,
+	0x781B, 0xA91A, 0x9A1A, 0x4B1B, 0xFC1A, 0x2D1B, 0x1E1B, 0xCF1A,
+	0x0011, 0xD110, 0xE210, 0x3311, 0x8410, 0x5511, 0x6611, 0xB710,
+	0x4810, 0x9911, 0xAA11, 0x7B10, 0xCC11, 0x1D10, 0x2E10, 0xFF11,
+	0x9013, 0x4112, 0x7212, 0xA313, 0x1412, 0xC513, 0xF613, 0x2712,
+	0xD812, 0x0913, 0x3A13, 0xEB12, 0x5C13, 0x8D12, 0xBE12, 0x6F13,
+	0x6016, 0xB117, 0x8217, 0x5316, 0xE417, 0x3516, 0x0616, 0xD717,
+	0x2817, 0xF916, 0xCA16, 0x1B17, 0xAC16, 0x7D17, 0x4E17, 0x9F16,
+	0xF014, 0x2115, 0x1215, 0xC314, 0x7415, 0xA514, 0x9614, 0x4715,
+	0xB815, 0x6914, 0x5A14, 0x8B15, 0x3C14, 0xED15, 0xDE15, 0x0F14
+    },
+    {
+	0x0000, 0xC010, 0xC023, 0x0033, 0xC045, 0x0055, 0x0066, 0xC076,
+	0xC089, 0x0099, 0x00AA, 0xC0BA, 0x00CC, 0xC0DC, 0xC0EF, 0x00FF,
+	0xC111, 0x0101, 0x0132, 0xC122, 0x0154, 0xC144, 0xC177, 0x0167,
+	0x0198, 0xC188, 0xC1BB, 0x01AB, 0xC1DD, 0x01CD, 0x01FE, 0xC1EE,
+	0xC221, 0x0231, 0x0202, 0xC212, 0x0264, 0xC274, 0xC247, 0x0257,
+	0x02A8, 0xC2B8, 0xC28B, 0x029B, 0xC2ED, 0x02FD, 0x02CE, 0xC2DE,
+	0x0330, 0xC320, 0xC313, 0x0303, 0xC375, 0x0365, 0x0356, 0xC346,
+	0xC3B9, 0x03A9, 0x039A, 0xC38A, 0x03FC, 0xC3EC, 0xC3DF, 0x03CF,
+	0xC441, 0x0451, 0x0462, 0xC472, 0x0404, 0xC414, 0xC427, 0x0437,
+	0x04C8, 0xC4D8, 0xC4EB, 0x04FB, 0xC48D, 0x049D, 0x04AE, 0xC4BE,
+	0x0550, 0xC540, 0xC573, 0x0563, 0xC515, 0x0505, 0x0536, 0xC526,
+	0xC5D9, 0x05C9, 0x05FA, 0xC5EA, 0x059C, 0xC58C, 0xC5BF, 0x05AF,
+	0x0660, 0xC670, 0xC643, 0x0653, 0xC625, 0x0635, 0x0606, 0xC616,
+	0xC6E9, 0x06F9, 0x06CA, 0xC6DA, 0x06AC, 0xC6BC, 0xC68F, 0x069F,
+	0xC771, 0x0761, 0x0752, 0xC742, 0x0734, 0xC724, 0xC717, 0x0707,
+	0x07F8, 0xC7E8, 0xC7DB, 0x07CB, 0xC7BD, 0x07AD, 0x079E, 0xC78E,
+	0xC881, 0x0891, 0x08A2, 0xC8B2, 0x08C4, 0xC8D4, 0xC8E7, 0x08F7,
+	0x0808, 0xC818, 0xC82B, 0x083B, 0xC84D, 0x085D, 0x086E, 0xC87E,
+	0x0990, 0xC980, 0xC9B3, 0x09A3, 0xC9D5, 0x09C5, 0x09F6, 0xC9E6,
+	0xC919, 0x0909, 0x093A, 0xC92A, 0x095C, 0xC94C, 0xC97F, 0x096F,
+	0x0AA0, 0xCAB0, 0xCA83, 0x0A93, 0xCAE5, 0x0AF5, 0x0AC6, 0xCAD6,
+	0xCA29, 0x0A39, 0x0A0A, 0xCA1A, 0x0A6C, 0xCA7C, 0xCA4F, 0x0A5F,
+	0xCBB1, 0x0BA1, 0x0B92, 0xCB82, 0x0BF4, 0xCBE4, 0xCBD7, 0x0BC7,
+	0x0B38, 0xCB28, 0xCB1B, 0x0B0B, 0xCB7D, 0x0B6D, 0x0B5E, 0xCB4E,
+	0x0CC0, 0xCCD0, 0xCCE3, 0x0CF3, 0xCC85, 0x0C95, 0x0CA6, 0xCCB6,
+	0xCC49, 0x0C59, 0x0C6A, 0xCC7A, 0x0C0C, 0xCC1C, 0xCC2F, 0x0C3F,
+	0xCDD1, 0x0DC1, 0x0DF2, 0xCDE2, 0x0D94, 0xCD84, 0xCDB7, 0x0DA7,
+	0x0D58, 0xCD48, 0xCD7B, 0x0D6B, 0xCD1D, 0x0D0D, 0x0D3E, 0xCD2E,
+	0xCEE1, 0x0EF1, 0x0EC2, 0xCED2, 0x0EA4, 0xCEB4, 0xCE87, 0x0E97,
+	0x0E68, 0xCE78, 0xCE4B, 0x0E5B, 0xCE2D, 0x0E3D, 0x0E0E, 0xCE1E,
+	0x0FF0, 0xCFE0, 0xCFD3, 0x0FC3, 0xCFB5, 0x0FA5, 0x0F96, 0xCF86,
+	0xCF79, 0x0F69, 0x0F5A, 0xCF4A, 0x0F3C, 0xCF2C, 0xCF1F, 0x0F0F
+    },
+    {
+	0x0000, 0xCCC1, 0xD981, 0x1540, 0xF301, 0x3FC0, 0x2A80, 0xE641,
+	0xA601, 0x6AC0, 0x7F80, 0xB341, 0x5500, 0x99C1, 0x8C81, 0x4040,
+	0x0C01, 0xC0C0, 0xD580, 0x1941, 0xFF00, 0x33C1, 0x2681, 0xEA40,
+	0xAA00, 0x66C1, 0x7381, 0xBF40, 0x5901, 0x95C0, 0x8080, 0x4C41,
+	0x1802, 0xD4C3, 0xC183, 0x0D42, 0xEB03, 0x27C2, 0x3282, 0xFE43,
+	0xBE03, 0x72C2, 0x6782, 0xAB43, 0x4D02, 0x81C3, 0x9483, 0x5842,
+	0x1403, 0xD8C2, 0xCD82, 0x0143, 0xE702, 0x2BC3, 0x3E83, 0xF242,
+	0xB202, 0x7EC3, 0x6B83, 0xA742, 0x4103, 0x8DC2, 0x9882, 0x5443,
+	0x3004, 0xFCC5, 0xE985, 0x2544, 0xC305, 0x0FC4, 0x1A84, 0xD645,
+	0x9605, 0x5AC4, 0x4F84, 0x8345, 0x6504, 0xA9C5, 0xBC85, 0x7044,
+	0x3C05, 0xF0C4, 0xE584, 0x2945, 0xCF04, 0x03C5, 0x1685, 0xDA44,
+	0x9A04, 0x56C5, 0x4385, 0x8F44, 0x6905, 0xA5C4, 0xB084, 0x7C45,
+	0x2806, 0xE4C7, 0xF187, 0x3D46, 0xDB07, 0x17C6, 0x0286, 0xCE47,
+	0x8E07, 0x42C6, 0x5786, 0x9B47, 0x7D06, 0xB1C7, 0xA487, 0x6846,
+	0x2407, 0xE8C6, 0xFD86, 0x3147, 0xD706, 0x1BC7, 0x0E87, 0xC246,
+	0x8206, 0x4EC7, 0x5B87, 0x9746, 0x7107, 0xBDC6, 0xA886, 0x6447,
+	0x6008, 0xACC9, 0xB989, 0x7548, 0x9309, 0x5FC8, 0x4A88, 0x8649,
+	0xC609, 0x0AC8, 0x1F88, 0xD349, 0x3508, 0xF9C9, 0xEC89, 0x2048,
+	0x6C09, 0xA0C8, 0xB588, 0x7949, 0x9F08, 0x53C9, 0x4689, 0x8A48,
+	0xCA08, 0x06C9, 0x1389, 0xDF48, 0x3909, 0xF5C8, 0xE088, 0x2C49,
+	0x780A, 0xB4CB, 0xA18B, 0x6D4A, 0x8B0B, 0x47CA, 0x528A, 0x9E4B,
+	0xDE0B, 0x12CA, 0x078A, 0xCB4B, 0x2D0A, 0xE1CB, 0xF48B, 0x384A,
+	0x740B, 0xB8CA, 0xAD8A, 0x614B, 0x870A, 0x4BCB, 0x5E8B, 0x924A,
+	0xD20A, 0x1ECB, 0x0B8B, 0xC74A, 0x210B, 0xEDCA, 0xF88A, 0x344B,
+	0x500C, 0x9CCD, 0x898D, 0x454C, 0xA30D, 0x6FCC, 0x7A8C, 0xB64D,
+	0xF60D, 0x3ACC, 0x2F8C, 0xE34D, 0x050C, 0xC9CD, 0xDC8D, 0x104C,
+	0x5C0D, 0x90CC, 0x858C, 0x494D, 0xAF0C, 0x63CD, 0x768D, 0xBA4C,
+	0xFA0C, 0x36CD, 0x238D, 0xEF4C, 0x090D, 0xC5CC, 0xD08C, 0x1C4D,
+	0x480E, 0x84CF, 0x918F, 0x5D4E, 0xBB0F, 0x77CE, 0x628E, 0xAE4F,
+	0xEE0F, 0x22CE, 0x378E, 0xFB4F, 0x1D0E, 0xD1CF, 0xC48F, 0x084E,
+	0x440F, 0x88CE, 0x9D8E, 0x514F, 0xB70E, 0x7BCF, 0x6E8F, 0xA24E,
+	0xE20E, 0x2ECF, 0x3B8F, 0xF74E, 0x110F, 0xDDCE, 0xC88E, 0x044F
     }
+};
+
+/*
+ * Calculate a CRC, the RNC way.
+ */
+long rnc_crc (void *data, long len) {
+    return rnc_crc_update (0, data, len);
+}
+
+/*
+ * Carry on a CRC over more data, so that it can be computed
+ * piecewise: rnc_crc_update (rnc_crc (a, n), b, m) is the CRC of
+ * a followed by b.
+ */
+long rnc_crc_update (long crc, void *data, long len) {
+    unsigned short val = crc;
+    unsigned char *p = data;
 
-    val = 0;
+    while (len >= 8) {
+	val = crctab[7][(p[0] ^ val) & 0xFF] ^ crctab[6][p[1] ^ (val >> 8)]
+	    ^ crctab[5][p[2]] ^ crctab[4][p[3]]
+	    ^ crctab[3][p[4]] ^ crctab[2][p[5]]
+	    ^ crctab[1][p[6]] ^ crctab[0][p[7]];
+	p += 8;
+	len -= 8;
+    }
     while (len--) {
 	val ^= *p++;
-	val = (val >> 8) ^ crctab[val & 0xFF];
+	val = (val >> 8) ^ crctab[0][val & 0xFF];
     }
 
     return val;
 }
 
+#ifdef BENCH
+#define BENCH_RUNS 20		       /* the fastest of these is kept */
+#define BENCH_SYNTH_SZ 0x400000	       /* size of the made-up corpus */
+
+/*
+ * A point in time, or the time between two: in seconds, and in
+ * time-stamp counter cycles where there is one (0 otherwise).
+ */
+typedef struct {
+    double secs;
+    unsigned long long cycles;
+} bench_clock;
+
+typedef struct {
+    long ulen, plen;
+    bench_clock unpack, crc, copy;
+} bench_result;
+
+static volatile long bench_sink;       /* keeps CRCs from being dropped */
+
+static bench_clock bench_now (void);
+static void bench_keep (bench_clock *best, bench_clock start);
+static void bench_add (bench_clock *total, bench_clock t);
+static void bench_print (char *name, bench_result *r);
+static int bench_block (char *name, unsigned char *packed,
+			bench_result *total);
+static int bench_file (char *pname, char *iname, bench_result *total);
+static unsigned char *bench_synth (long len);
+static unsigned long bench_rand (unsigned long *seed);
+
+int main(int argc, char **argv) {
+    bench_result total = { 0 };
+    unsigned char *data;
+    void *packed;
+    long plen;
+    int i;
+
+    if (argc > 1) {
+	for (i=1; i < argc; i++)
+	    if (bench_file (*argv, argv[i], &total))
+		return 1;
+	if (argc > 2)
+	    bench_print ("total", &total);
+	return 0;
+    }
+
+    data = bench_synth (BENCH_SYNTH_SZ);
+    if (!data) {
+	fprintf(stderr, "%s: %s\n", *argv, rnc_error (RNC_OUT_OF_MEMORY));
+	return 1;
+    }
+    plen = rnc_pack (data, BENCH_SYNTH_SZ, &packed, RNC_LEVEL_LAZY);
+    free (data);
+    if (plen < 0) {
+	fprintf(stderr, "%s: %s\n", *argv, rnc_error (plen));
+	return 1;
+    }
+    i = bench_block ("synthetic", packed, &total);
+    free (packed);
+    return i;
+}
+
+/*
+ * Time a file: as it is if it's packed already, like a PAK, or
+ * after packing it if not.
+ */
+static int bench_file (char *pname, char *iname, bench_result *total)
+{
+    FILE *ifp;
+    long len, plen;
+    unsigned char *buf;
+    void *packed;
+    int ret;
+
+    ifp = fopen(iname, "rb");
+    if (!ifp) {
+	perror(iname);
+	return 1;
+    }
+    fseek (ifp, 0L, SEEK_END);
+    len = ftell (ifp);
+    rewind (ifp);
+    buf = malloc(len + 18);	       /* room for an empty header */
+    if (!buf || fread (buf, 1, len, ifp) != len) {
+	perror(iname);
+	fclose (ifp);
+	free (buf);
+	return 1;
+    }
+    fclose (ifp);
+
+    if (len >= 18 && rnc_ulen (buf) >= 0
+	&& 18 + blong (buf+8) <= len) {
+	ret = bench_block (iname, buf, total);
+	free (buf);
+	return ret;
+    }
+
+    plen = rnc_pack (buf, len, &packed, RNC_LEVEL_LAZY);
+    free (buf);
+    if (plen < 0) {
+	fprintf(stderr, "%s: %s: %s\n", pname, iname, rnc_error (plen));
+	return 1;
+    }
+    ret = bench_block (iname, packed, total);
+    free (packed);
+    return ret;
+}
+
+/*
+ * Time one packed block. The whole of rnc_unpack is timed, then the
+ * two CRCs it computes, then its match copies replayed on their own
+ * over the unpacked data; what's left is put down to Huffman
+ * decoding, which includes moving the literals.
+ */
+static int bench_block (char *name, unsigned char *packed,
+			bench_result *total)
+{
+    bench_result r = { 0 };
+    bench_clock start;
+    struct bench_match *log;
+    unsigned char *out;
+    long ret, n, i;
+    int run;
+
+    r.ulen = rnc_ulen (packed);
+    r.plen = blong (packed+8);
+    out = malloc (r.ulen + RNC_UNPACK_SLACK);
+    log = malloc ((r.ulen / 2 + 1) * sizeof *log);
+    if (!out || !log) {
+	fprintf(stderr, "%s: %s\n", name, rnc_error (RNC_OUT_OF_MEMORY));
+	free (out);
+	free (log);
+	return 1;
+    }
+
+    bench_log = log;		       /* matches are at least 2 bytes */
+    bench_nlog = 0;
+    ret = rnc_unpack (packed, out);
+    n = bench_nlog;
+    bench_log = NULL;
+    if (ret < 0) {
+	fprintf(stderr, "%s: %s\n", name, rnc_error (ret));
+	free (out);
+	free (log);
+	return 1;
+    }
+
+    r.unpack.secs = r.crc.secs = r.copy.secs = -1;
+    for (run = 0; run < BENCH_RUNS; run++) {
+	start = bench_now ();
+	rnc_unpack (packed, out);
+	bench_keep (&r.unpack, start);
+
+	start = bench_now ();
+	bench_sink = rnc_crc (packed+18, r.plen) ^ rnc_crc (out, r.ulen);
+	bench_keep (&r.crc, start);
+
+	/*
+	 * The bytes copies write past a match's end aren't put right
+	 * here as they are when unpacking, but the copies take as long.
+	 */
+	start = bench_now ();
+	for (i = 0; i < n; i++)
+	    copy_match (out + log[i].out, log[i].posn, log[i].length);
+	bench_keep (&r.copy, start);
+    }
+    free (out);
+    free (log);
+
+    bench_print (name, &r);
+    total->ulen += r.ulen;
+    total->plen += r.plen;
+    bench_add (&total->unpack, r.unpack);
+    bench_add (&total->crc, r.crc);
+    bench_add (&total->copy, r.copy);
+    return 0;
+}
+
+static void bench_print (char *name, bench_result *r)
+{
+    double secs = r->unpack.secs, huf;
+
+    huf = secs - r->crc.secs - r->copy.secs;
+    if (huf < 0)
+	huf = 0;
+    printf("%s: %ld -> %ld bytes, %.1f MB/s", name, r->plen, r->ulen,
+	   secs > 0 ? r->ulen / secs / 1e6 : 0.0);
+    if (r->unpack.cycles && r->ulen)
+	printf(", %.2f cycles/byte", (double) r->unpack.cycles / r->ulen);
+    if (secs > 0)
+	printf("\n    huffman %.1f%%, match copy %.1f%%, crc %.1f%%",
+	       100 * huf / secs, 100 * r->copy.secs / secs,
+	       100 * r->crc.secs / secs);
+    printf("\n");
+}
+
+static bench_clock bench_now (void) {
+    bench_clock c;
+    struct timespec ts;
+
+    timespec_get (&ts, TIME_UTC);
+    c.secs = ts.tv_sec + ts.tv_nsec / 1e9;
+#ifdef HAVE_RDTSC
+    c.cycles = __rdtsc ();
+#else
+    c.cycles = 0;
+#endif
+    return c;
+}
+
+/*
+ * Time since start, kept in best if it's the fastest yet.
+ */
+static void bench_keep (bench_clock *best, bench_clock start) {
+    bench_clock t = bench_now ();
+
+    t.secs -= start.secs;
+    t.cycles -= start.cycles;
+    if (best->secs < 0 || t.secs < best->secs)
+	*best = t;
+}
+
+static void bench_add (bench_clock *total, bench_clock t) {
+    total->secs += t.secs;
+    total->cycles += t.cycles;
+}
+
+/*
+ * Make up data that packs about as well as the game's: runs of
+ * skewed literals, and repeats of what came before at all distances.
+ */
+static unsigned char *bench_synth (long len) {
+    unsigned char *p;
+    unsigned long seed = 1;
+    long i = 0, n, d;
+
+    p = malloc (len);
+    if (!p)
+	return NULL;
+    while (i < len) {
+	n = 1 + bench_rand (&seed) % 32;
+	if (n > len - i)
+	    n = len - i;
+	if (i < 256 || bench_rand (&seed) % 3 == 0) {
+	    while (n--) {
+		p[i] = bench_rand (&seed) % 64;
+		p[i] = p[i] * p[i] >> 4;
+		i++;
+	    }
+	} else {
+	    d = bench_rand (&seed);
+	    d = 1 + (d * d >> 15) % (i < 0xFFFF ? i : 0xFFFF);
+	    while (n--) {
+		p[i] = p[i-d];
+		i++;
+	    }
+	}
+    }
+    return p;
+}
+
+/*
+ * 15 bits from a linear congruential generator.
+ */
+static unsigned long bench_rand (unsigned long *seed) {
+    *seed = (*seed * 1103515245 + 12345) & 0xFFFFFFFF;
+    return (*seed >> 16) & 0x7FFF;
+}
+#endif
+
+#ifdef TEST
+#define TEST_SZ 0x1000		       /* size of the unpacked test data */
+
+typedef struct {
+    unsigned char *next;
+    long left;
+} test_src;
+
+static long test_read (void *ctx, void *buf, long len);
+static long test_stream (unsigned char *packed, long len);
+
+/*
+ * A block is packed, then streamed with its packed length cut short
+ * at every length. The bit reader runs past the end of such data,
+ * which must be reported as an error rather than read from; build
+ * with -fsanitize=address to catch any such read.
+ */
+int main(int argc, char **argv) {
+    unsigned char data[TEST_SZ];
+    unsigned char *packed;
+    void *p;
+    unsigned long seed = 1;
+    long plen, cut, ret;
+    int i, fails = 0;
+
+    (void) argc;
+    for (i=0; i < TEST_SZ; i++) {
+	seed = (seed * 1103515245 + 12345) & 0xFFFFFFFF;
+	data[i] = i < 16 || i % 7 < 3 ? seed >> 16 : data[i-10];
+    }
+    plen = rnc_pack (data, TEST_SZ, &p, RNC_LEVEL_LAZY);
+    if (plen < 0) {
+	fprintf(stderr, "%s: %s\n", *argv, rnc_error (plen));
+	return 1;
+    }
+    packed = p;
+
+    ret = test_stream (packed, plen);
+    if (ret != TEST_SZ) {
+	fprintf(stderr, "%s: whole block: %s\n", *argv, rnc_error (ret));
+	fails++;
+    }
+    for (cut = 0; cut < plen - 18; cut++) {
+	packed[8] = cut >> 24;
+	packed[9] = cut >> 16;
+	packed[10] = cut >> 8;
+	packed[11] = cut;
+	ret = test_stream (packed, 18 + cut);
+	if (ret >= 0) {
+	    fprintf(stderr, "%s: block cut to %ld bytes was accepted\n",
+		    *argv, cut);
+	    fails++;
+	}
+    }
+    free (packed);
+
+    printf("%s\n", fails ? "FAIL" : "ok");
+    return fails != 0;
+}
+
+static long test_read (void *ctx, void *buf, long len) {
+    test_src *src = ctx;
+
+    if (len > src->left)
+	len = src->left;
+    memcpy (buf, src->next, len);
+    src->next += len;
+    src->left -= len;
+    return len;
+}
+
+/*
+ * Stream the len bytes of a block through, returning its unpacked
+ * length or a negative error code.
+ */
+static long test_stream (unsigned char *packed, long len) {
+    test_src src = { packed, len };
+    unsigned char buf[0x1000];
+    rnc_stream *rs;
+    long ret, n;
+
+    ret = rnc_open (&rs, test_read, &src);
+    if (ret < 0)
+	return ret;
+    ret = 0;
+    while ((n = rnc_read (rs, buf, sizeof buf)) > 0)
+	ret += n;
+    rnc_close (rs);
+    return n < 0 ? n : ret;
+}
+#endif
+
 #pragma GCC diagnostic pop
@@ -16,6 +16,28 @@ long rnc_unpack (void *packed, void *unpacked, long *leeway);
 #endif
 char *rnc_error (long errcode);
 long rnc_crc (void *data, long len);
+long rnc_crc_update (long crc, void *data, long len);
+
+/*
+ * Streaming: `read' is asked for up to len bytes of packed data at
+ * a time, and returns how many it read, or a negative number on
+ * error.
+ */
+typedef struct rnc_stream rnc_stream;
+typedef long rnc_read_fn (void *ctx, void *buf, long len);
+
+long rnc_open (rnc_stream **rs, rnc_read_fn *read, void *ctx);
+long rnc_packed_len (rnc_stream *rs);
+long rnc_peek (rnc_stream *rs, void **buf);
+long rnc_skip (rnc_stream *rs, long len);
+long rnc_read (rnc_stream *rs, void *buf, long len);
+void rnc_close (rnc_stream *rs);
+
+/*
+ * How much room rnc_unpack needs past the end of the unpacked data,
+ * which it may overwrite while copying
+ */
+#define RNC_UNPACK_SLACK 16
 
 /*
  * Error returns
@@ -25,6 +47,8 @@ long rnc_crc (void *data, long len);
 #define RNC_FILE_SIZE_MISMATCH -3
 #define RNC_PACKED_CRC_ERROR   -4
 #define RNC_UNPACKED_CRC_ERROR -5
+#define RNC_INPUT_ERROR        -6
+#define RNC_OUT_OF_MEMORY      -7
 
 /*
  * The compressor needs this define
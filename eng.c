@@ -16,8 +16,10 @@
  * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +29,22 @@
 #include "stream.h"
 #include "utils.h"
 
+#define HDR_FIELDS(X) \
+	X(file_sz)      \
+	X(num_events)   \
+	X(num_topics)   \
+	X(num_replies)  \
+	X(unk_0)        \
+	X(unk_1)        \
+	X(unk_2)        \
+	X(unk_3)
+
+static const struct slv_field hdr_fields[] = {
+#define X(field) SLV_FIELD(struct slv_eng_hdr, field),
+	HDR_FIELDS(X)
+#undef X
+};
+
 static bool check_args(const void *me)
 {
 	return slv_check_args(me, 2, SLV_ERR_ENG_ARGS);
@@ -81,41 +99,43 @@ static bool load_reply(struct slv_eng_reply *reply, struct slv_stream *stream)
 	       && (reply->text = slv_read_str(stream));
 }
 
-static void unxor(size_t pos, void *buf, size_t sz)
+#define KEY_PERIOD 192
+
+/*
+ * The key byte at position pos is key[pos % 3] - 4 * (pos / 3), which repeats
+ * every 192 bytes, so the whole file is unxored against a precomputed period
+ */
+static void unxor(unsigned char *buf, size_t sz)
 {
-	for (size_t i = 0; i < sz; ++i, ++pos) {
-		unsigned char *bytes = buf;
-		unsigned char key[] = {0x52, 0xa6, 0xfa};
-		bytes[i] ^= (unsigned char)
-		            (key[pos % sizeof key] - 4 * (pos / sizeof key));
+	static const unsigned char key[] = {0x52, 0xa6, 0xfa};
+	unsigned char sched[KEY_PERIOD];
+	for (size_t pos = 0; pos < sizeof sched; ++pos)
+		sched[pos] = (unsigned char)(key[pos % sizeof key]
+		                             - 4 * (pos / sizeof key));
+	for (size_t i = 0; i < sz; i += sizeof sched) {
+		size_t len = sz - i < sizeof sched ? sz - i : sizeof sched;
+		for (size_t j = 0; j < len; ++j)
+			buf[i + j] ^= sched[j];
 	}
 }
 
-static bool load(void *me, struct slv_stream *stream)
+static bool parse(void *me, struct slv_stream *stream)
 {
 	struct slv_eng *eng = me;
 	struct slv_eng_hdr *hdr = &eng->hdr;
-	stream->callback = unxor;
-	if (!slv_read_le(stream, &hdr->file_sz)
-	    || !slv_read_le(stream, &hdr->num_events)
+	if (!slv_read_fields(stream, hdr_fields, SLV_LEN(hdr_fields), hdr)
 	    || !(eng->events = slv_alloc(hdr->num_events,
 	                                 sizeof eng->events[0],
 	                                 &(struct slv_eng_event) {0},
 	                                 stream->err))
-	    || !slv_read_le(stream, &hdr->num_topics)
 	    || !(eng->topics = slv_alloc(hdr->num_topics,
 	                                 sizeof eng->topics[0],
 	                                 &(struct slv_eng_topic) {0},
 	                                 stream->err))
-	    || !slv_read_le(stream, &hdr->num_replies)
 	    || !(eng->replies = slv_alloc(hdr->num_replies,
 	                                  sizeof eng->replies[0],
 	                                  &(struct slv_eng_reply) {0},
-	                                  stream->err))
-	    || !slv_read_le(stream, &hdr->unk_0)
-	    || !slv_read_le(stream, &hdr->unk_1)
-	    || !slv_read_le(stream, &hdr->unk_2)
-	    || !slv_read_le(stream, &hdr->unk_3))
+	                                  stream->err)))
 		return false;
 	for (size_t i = 0; i < hdr->num_events; ++i)
 		if (!load_event(&eng->events[i], stream))
@@ -133,6 +153,103 @@ static bool load(void *me, struct slv_stream *stream)
 	return true;
 }
 
+static bool validate_unxored(void *me, struct slv_stream *stream)
+{
+	(void)me;
+	struct slv_eng_hdr hdr;
+	if (!slv_read_fields(stream, hdr_fields, SLV_LEN(hdr_fields), &hdr))
+		return false;
+	for (size_t i = 0; i < hdr.num_events; ++i) {
+		unsigned long num_topic_names;
+		if (!slv_read_le(stream, &num_topic_names)
+		    || !slv_skip(stream, 5, 4))
+			return false;
+		// Name, trigger and topic names
+		for (size_t j = 0; j < num_topic_names + 2; ++j)
+			if (!slv_skip_str(stream))
+				return false;
+	}
+	for (size_t i = 0; i < hdr.num_topics; ++i) {
+		unsigned long num_reply_names;
+		if (!slv_read_le(stream, &num_reply_names)
+		    || !slv_skip(stream, 4, 4))
+			return false;
+		// Name and reply names
+		for (size_t j = 0; j < num_reply_names + 1; ++j)
+			if (!slv_skip_str(stream))
+				return false;
+	}
+	for (size_t i = 0; i < 5 * hdr.num_replies; ++i)
+		if (!slv_skip_str(stream))
+			return false;
+	if (hdr.file_sz != stream->pos) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_FILE_SZ);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The whole file is unxored at once, then parsed from memory. Its size comes
+ * from the header, so the rest of a mapped file is borrowed first, which checks
+ * the size against the stream before it is copied to be unxored. Other inputs
+ * are read straight into the buffer, which is unxored in place.
+ */
+static bool unxor_then(bool (*fn)(void *, struct slv_stream *), void *me,
+                       struct slv_stream *stream)
+{
+	unsigned char raw_sz[4];
+	if (!slv_read_buf(stream, raw_sz, sizeof raw_sz))
+		return false;
+	unsigned char plain_sz[sizeof raw_sz];
+	memcpy(plain_sz, raw_sz, sizeof raw_sz);
+	unxor(plain_sz, sizeof plain_sz);
+	unsigned long file_sz = 0;
+	for (size_t i = 0; i < sizeof plain_sz; ++i)
+		file_sz |= (unsigned long)plain_sz[i] << i * CHAR_BIT;
+	if (file_sz < sizeof raw_sz || file_sz > SIZE_MAX) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_FILE_SZ);
+		return false;
+	}
+	size_t rest_sz = file_sz - sizeof raw_sz;
+	const void *lent = NULL;
+	if (slv_can_lend(stream)
+	    && !(lent = slv_borrow_buf(stream, rest_sz, NULL)))
+		return false;
+	bool ret = false;
+	unsigned char *buf = slv_malloc(file_sz, stream->err);
+	if (!buf)
+		return false;
+	memcpy(buf, raw_sz, sizeof raw_sz);
+	if (lent)
+		memcpy(&buf[sizeof raw_sz], lent, rest_sz);
+	else if (!slv_read_buf(stream, &buf[sizeof raw_sz], rest_sz))
+		goto free_buf;
+	unxor(buf, file_sz);
+	struct slv_stream *ms = slv_new_ms(buf, file_sz, stream->err);
+	if (!ms)
+		goto free_buf;
+	ret = fn(me, ms);
+	// The bytes parsed were already counted as they were read from stream
+	stream->stats.num_reads += ms->stats.num_reads;
+	stream->stats.num_str_reallocs += ms->stats.num_str_reallocs;
+	SLV_DEL(ms);
+free_buf:
+	free(buf);
+	return ret;
+}
+
+static bool load(void *me, struct slv_stream *stream)
+{
+	return unxor_then(parse, me, stream);
+}
+
+static bool validate(const void *me, struct slv_stream *stream)
+{
+	(void)me;
+	return unxor_then(validate_unxored, NULL, stream);
+}
+
 static struct slv_eng_reply *get_reply(const struct slv_eng *eng,
                                        const char *name)
 {
@@ -278,6 +395,7 @@ static void del(void *me)
 static const struct slv_asset_ops ops = {
 	.check_args = check_args,
 	.load = load,
+	.validate = validate,
 	.save = save,
 	.del = del,
 };
@@ -0,0 +1,900 @@
+/*
+ * enrnc.c   compress data into RNC format
+ *
+ * Compiled normally, this file is a well-behaved, re-entrant code
+ * module exporting only `rnc_pack'. It uses the CRC routine from
+ * dernc.c.
+ * Compiled with ENRNC_MAIN defined (and linked with dernc.c), it's a
+ * standalone program which will compress argv[1] into argv[2], or
+ * with -b, time each level on the files given and check that the
+ * output unpacks back to them.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+
+#ifdef ENRNC_MAIN
+# include <stdio.h>
+# include <time.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERNAL
+#include "dernc.h"
+#include "enrnc.h"
+
+#ifdef ENRNC_MAIN
+int main_pack (char *pname, char *iname, char *oname, int level);
+int main_bench (char *pname, char *iname);
+void *read_file (char *iname, long *len);
+
+int main(int argc, char **argv) {
+    int level = RNC_LEVEL_LAZY;
+    int i;
+
+    if (argc > 1 && !strcmp (argv[1], "-b"))
+    {
+	for (i=2; i < argc; i++)
+	    if (main_bench (*argv, argv[i]))
+		return 1;
+	return 0;
+    }
+    if (argc == 4 && argv[1][0] == '-' && argv[1][1] >= '1'
+	&& argv[1][1] <= '3' && !argv[1][2])
+    {
+	level = argv[1][1] - '0';
+	argv++;
+	argc--;
+    }
+    if (argc != 3)
+    {
+	fprintf(stderr, "usage: %s [-1|-2|-3] <infile> <outfile>"
+		" or %s -b <files>\n", *argv, *argv);
+	return 1;
+    }
+    return main_pack (*argv, argv[1], argv[2], level);
+}
+
+void *read_file (char *iname, long *len)
+{
+    FILE *ifp;
+    void *buf;
+
+    ifp = fopen(iname, "rb");
+    if (!ifp) {
+	perror(iname);
+	return NULL;
+    }
+    fseek (ifp, 0L, SEEK_END);
+    *len = ftell (ifp);
+    rewind (ifp);
+    buf = malloc(*len ? *len : 1);
+    if (!buf || fread (buf, 1, *len, ifp) != *len) {
+	perror(iname);
+	free (buf);
+	buf = NULL;
+    }
+    fclose (ifp);
+    return buf;
+}
+
+int main_pack (char *pname, char *iname, char *oname, int level)
+{
+    FILE *ofp;
+    long ulen, plen;
+    void *unpacked, *packed;
+
+    unpacked = read_file (iname, &ulen);
+    if (!unpacked)
+	return 1;
+
+    plen = rnc_pack (unpacked, ulen, &packed, level);
+    free (unpacked);
+    if (plen < 0) {
+	fprintf(stderr, "%s: %s\n", pname, rnc_error (plen));
+	return 1;
+    }
+
+    ofp = fopen(oname, "wb");
+    if (!ofp) {
+	perror(oname);
+	free (packed);
+	return 1;
+    }
+    fwrite (packed, 1, plen, ofp);
+    fclose (ofp);
+    if (((unsigned char *) packed)[16] == 0xFF)
+	fprintf(stderr, "%s: %s: leeway 255 or more, stored as 255\n",
+		pname, oname);
+    free (packed);
+
+    return 0;
+}
+
+int main_bench (char *pname, char *iname)
+{
+    static const char *const names[] = { "", "fast", "lazy", "best" };
+    long ulen, plen, len;
+    void *unpacked, *packed;
+    unsigned char *check;
+    clock_t start;
+    double secs;
+    int level, lee;
+
+    unpacked = read_file (iname, &ulen);
+    if (!unpacked)
+	return 1;
+    check = malloc (ulen + RNC_UNPACK_SLACK);
+    if (!check) {
+	perror(pname);
+	free (unpacked);
+	return 1;
+    }
+
+    for (level = RNC_LEVEL_FAST; level <= RNC_LEVEL_BEST; level++) {
+	start = clock ();
+	plen = rnc_pack (unpacked, ulen, &packed, level);
+	secs = (double) (clock () - start) / CLOCKS_PER_SEC;
+	if (plen < 0) {
+	    fprintf(stderr, "%s: %s\n", pname, rnc_error (plen));
+	    break;
+	}
+	len = rnc_unpack (packed, check);
+	if (len != ulen || memcmp (check, unpacked, ulen)) {
+	    fprintf(stderr, "%s: %s: level %d does not unpack: %s\n",
+		    pname, iname, level,
+		    len < 0 ? rnc_error (len) : "Data mismatch");
+	    free (packed);
+	    plen = -1;
+	    break;
+	}
+	lee = ((unsigned char *) packed)[16];
+	printf("%s: level %d (%s): %ld -> %ld bytes (%.1f%%), "
+	       "%.2f MB/s, leeway %d%s\n", iname, level, names[level],
+	       ulen, plen, ulen ? 100.0 * plen / ulen : 0.0,
+	       secs > 0 ? ulen / secs / 1e6 : 0.0,
+	       lee, lee == 0xFF ? " or more" : "");
+	free (packed);
+    }
+
+    free (check);
+    free (unpacked);
+    return plen < 0;
+}
+#endif
+
+#define CHUNK_SZ 0x3000		       /* unpacked bytes per chunk */
+#define WINDOW 0x10000		       /* size of the hash chain window */
+#define MAX_DIST (WINDOW-1)	       /* furthest back a match can go */
+#define MIN_MATCH 3
+#define HASH_BITS 15
+#define NUM_SYMS 17		       /* values take at most 16 bits */
+#define MAX_CODELEN 15
+#define MAX_CANDS 16		       /* matches kept per position */
+#define INF 0x7FFFFFFFL
+
+/*
+ * Search effort for each level: how many earlier positions to try,
+ * the match length past which fewer are tried (and lazy matching
+ * stops looking ahead), and the one past which searching stops.
+ */
+static const struct {
+    int chain;
+    long good;
+    long nice;
+} levels[] = {
+    { 0, 0, 0 },
+    { 8, 16, 32 },		       /* RNC_LEVEL_FAST */
+    { 32, 16, 128 },		       /* RNC_LEVEL_LAZY */
+    { 128, 32, 256 },		       /* RNC_LEVEL_BEST */
+};
+
+/*
+ * A literal run, followed by a match unless len is 0.
+ */
+typedef struct {
+    long run;
+    long len;
+    long dist;
+} token;
+
+typedef struct {
+    int num;			       /* number of code lengths stored */
+    int codelen[NUM_SYMS];
+    unsigned long code[NUM_SYMS];
+} huf_table;
+
+/*
+ * Costs in bits of each symbol, used for optimal parsing.
+ */
+typedef struct {
+    int raw[NUM_SYMS];
+    int dist[NUM_SYMS];
+    int len[NUM_SYMS];
+} cost_model;
+
+typedef struct {
+    unsigned char *data;
+    long ulen;
+    int level, lee;
+    long ins;			       /* positions before this are hashed */
+    long head[1 << HASH_BITS];
+    long prev[WINDOW];
+
+    token tokens[CHUNK_SZ + 1];
+    long ntokens;
+
+    unsigned char *out;		       /* header, then packed data */
+    long out_sz;
+    long pos;			       /* end of the packed data */
+    long wpos;			       /* word being filled */
+    unsigned long val;
+    int nbits;			       /* bits used in that word */
+    long lee_delta;		       /* see emit_chunk */
+
+    /* optimal parsing, per chunk position */
+    unsigned char ncands[CHUNK_SZ];
+    long cand_len[CHUNK_SZ][MAX_CANDS];
+    long cand_dist[CHUNK_SZ][MAX_CANDS];
+    long mcost[CHUNK_SZ + 1];	       /* cost to a match ending here */
+    long mfrom[CHUNK_SZ + 1];	       /* where that match started */
+    long mlen[CHUNK_SZ + 1];
+    long mdist[CHUNK_SZ + 1];
+    long mrun[CHUNK_SZ + 1];	       /* where the run before it started */
+    long litstart[CHUNK_SZ + 1];
+    long litcost[CHUNK_SZ + 1];
+} packer;
+
+static void insert_upto (packer *pk, long pos);
+static long find_match (packer *pk, long pos, long end, long *dist);
+static long match_len (unsigned char *p, unsigned char *q, long limit);
+static int find_cands (packer *pk, long pos, long end,
+		       long *lens, long *dists);
+
+static void parse_greedy (packer *pk, long start, long end);
+static void parse_lazy (packer *pk, long start, long end);
+static void parse_optimal (packer *pk, long start, long end);
+static void optimal_pass (packer *pk, long start, long end,
+			  const cost_model *cm);
+static void add_token (packer *pk, long run, long len, long dist);
+
+static int emit_chunk (packer *pk, long start);
+static void count_tokens (packer *pk, unsigned long *raw,
+			  unsigned long *dist, unsigned long *len);
+static void build_table (huf_table *h, const unsigned long *freq);
+static void huf_lengths (const unsigned long *freq, int *codelen);
+static void put_table (packer *pk, huf_table *h);
+static void put_value (packer *pk, huf_table *h, unsigned long n);
+static void put_bits (packer *pk, unsigned long v, int n);
+static int reserve (packer *pk, long n);
+
+static int value_sym (unsigned long n);
+static int value_bits (const int *costs, unsigned long n);
+static void put_blong (unsigned char *p, unsigned long n);
+static void put_bword (unsigned char *p, unsigned long n);
+static unsigned long mirror (unsigned long x, int n);
+
+/*
+ * Compress ulen bytes at unpacked with the given level, from
+ * RNC_LEVEL_FAST to RNC_LEVEL_BEST. Returns the packed length,
+ * having set `*packed' to a malloced buffer holding the header and
+ * the packed data, or a negative error code.
+ *
+ * The leeway the unpacker would report is stored in the header. It
+ * only has one byte there, so a leeway over 255, as incompressible
+ * data can need, is stored as 255 and is then too small to unpack
+ * the data in place.
+ */
+long rnc_pack (void *unpacked, long ulen, void **packed, int level) {
+    packer *pk;
+    long start, end, plen, lee;
+    int chunks = 0;
+
+    *packed = NULL;
+    pk = malloc (sizeof *pk);
+    if (!pk)
+	return RNC_OUT_OF_MEMORY;
+    pk->data = unpacked;
+    pk->ulen = ulen;
+    pk->level = level < RNC_LEVEL_FAST ? RNC_LEVEL_FAST
+	      : level > RNC_LEVEL_BEST ? RNC_LEVEL_BEST : level;
+    pk->ins = 0;
+    memset (pk->head, 0xFF, sizeof pk->head);
+    pk->out_sz = 18 + ulen + ulen / 8 + 64;
+    pk->out = malloc (pk->out_sz);
+    if (!pk->out) {
+	free (pk);
+	return RNC_OUT_OF_MEMORY;
+    }
+    pk->pos = 18;		       /* leave room for the header */
+    pk->nbits = 16;		       /* no word started */
+    pk->lee_delta = -INF;	       /* no match yet */
+
+    put_bits (pk, 0, 2);	       /* two unused bits */
+
+    for (start = 0; start < ulen; start = end) {
+	end = start + CHUNK_SZ < ulen ? start + CHUNK_SZ : ulen;
+	pk->ntokens = 0;
+	switch (pk->level) {
+	  case RNC_LEVEL_FAST:
+	    parse_greedy (pk, start, end);
+	    break;
+	  case RNC_LEVEL_LAZY:
+	    parse_lazy (pk, start, end);
+	    break;
+	  default:
+	    parse_optimal (pk, start, end);
+	}
+	if (!emit_chunk (pk, start)) {
+	    free (pk->out);
+	    free (pk);
+	    return RNC_OUT_OF_MEMORY;
+	}
+	chunks++;
+    }
+
+    plen = pk->pos - 18;
+    lee = pk->lee_delta == -INF ? 0 : plen - ulen + pk->lee_delta;
+    if (lee < 0)
+	lee = 0;
+    if (lee > 0xFF)
+	lee = 0xFF;		       /* the most the header can hold */
+
+    put_blong (pk->out, RNC_SIGNATURE);
+    put_blong (pk->out+4, ulen);
+    put_blong (pk->out+8, plen);
+    put_bword (pk->out+12, rnc_crc (unpacked, ulen));
+    put_bword (pk->out+14, rnc_crc (pk->out+18, plen));
+    pk->out[16] = lee;
+    pk->out[17] = chunks;
+
+    *packed = pk->out;
+    plen = pk->pos;
+    free (pk);
+    return plen;
+}
+
+/*
+ * Add the positions up to pos to the hash chains.
+ */
+static void insert_upto (packer *pk, long pos) {
+    unsigned char *p;
+    unsigned long h;
+
+    if (pos > pk->ulen - 2)
+	pos = pk->ulen - 2;
+    for (; pk->ins < pos; pk->ins++) {
+	p = pk->data + pk->ins;
+	h = ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761UL) & 0xFFFFFFFF;
+	h >>= 32 - HASH_BITS;
+	pk->prev[pk->ins & (WINDOW-1)] = pk->head[h];
+	pk->head[h] = pk->ins;
+    }
+}
+
+/*
+ * Look for matches at pos that end by end, hashing everything before
+ * pos first. Every match longer than the ones before it is stored,
+ * so the lengths go up, and their number is returned.
+ */
+static int find_cands (packer *pk, long pos, long end,
+		       long *lens, long *dists) {
+    unsigned char *data = pk->data;
+    unsigned char *p = data + pos;
+    long limit = end - pos, best = MIN_MATCH - 1, cand, l;
+    int chain = levels[pk->level].chain;
+    long nice = levels[pk->level].nice;
+    unsigned long h;
+    int n = 0;
+
+    if (limit < MIN_MATCH)
+	return 0;
+    insert_upto (pk, pos);
+    h = ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761UL) & 0xFFFFFFFF;
+    cand = pk->head[h >> (32 - HASH_BITS)];
+    while (cand >= 0 && pos - cand <= MAX_DIST && chain-- > 0) {
+	unsigned char *q = data + cand;
+	if (q[best] == p[best]) {
+	    l = match_len (p, q, limit);
+	    if (l > best) {
+		best = l;
+		if (n == MAX_CANDS)
+		    n--;
+		lens[n] = l;
+		dists[n] = pos - cand;
+		n++;
+		if (l >= nice || l == limit)
+		    break;
+		if (l >= levels[pk->level].good)
+		    chain >>= 2;
+	    }
+	}
+	cand = pk->prev[cand & (WINDOW-1)];
+    }
+    return n;
+}
+
+/*
+ * Return how many bytes at p and q are the same, up to limit,
+ * comparing 8 at a time while they last.
+ */
+static long match_len (unsigned char *p, unsigned char *q, long limit) {
+    unsigned long long a, b;
+    long l = 0;
+
+    while (limit - l >= 8) {
+	memcpy (&a, p + l, 8);
+	memcpy (&b, q + l, 8);
+	if (a != b)
+	    break;
+	l += 8;
+    }
+    while (l < limit && p[l] == q[l])
+	l++;
+    return l;
+}
+
+/*
+ * Return the length of the longest match at pos, setting `*dist',
+ * or 0 if there is none.
+ */
+static long find_match (packer *pk, long pos, long end, long *dist) {
+    long lens[MAX_CANDS], dists[MAX_CANDS];
+    int n = find_cands (pk, pos, end, lens, dists);
+
+    if (!n)
+	return 0;
+    *dist = dists[n-1];
+    return lens[n-1];
+}
+
+static void add_token (packer *pk, long run, long len, long dist) {
+    token *t = &pk->tokens[pk->ntokens++];
+    t->run = run;
+    t->len = len;
+    t->dist = dist;
+}
+
+/*
+ * Take the longest match at each position.
+ */
+static void parse_greedy (packer *pk, long start, long end) {
+    long pos = start, run = 0, len, dist;
+
+    while (pos < end) {
+	len = find_match (pk, pos, end, &dist);
+	if (len) {
+	    add_token (pk, run, len, dist);
+	    pos += len;
+	    run = 0;
+	} else {
+	    pos++;
+	    run++;
+	}
+    }
+    add_token (pk, run, 0, 0);
+}
+
+/*
+ * Take the longest match at each position, unless the next position
+ * has a longer one.
+ */
+static void parse_lazy (packer *pk, long start, long end) {
+    long pos = start, run = 0, len, dist, len2, dist2;
+
+    len = find_match (pk, pos, end, &dist);
+    while (pos < end) {
+	if (len && len < levels[pk->level].good && pos + 1 < end) {
+	    len2 = find_match (pk, pos + 1, end, &dist2);
+	    if (len2 > len) {
+		pos++;
+		run++;
+		len = len2;
+		dist = dist2;
+		continue;
+	    }
+	}
+	if (len) {
+	    add_token (pk, run, len, dist);
+	    pos += len;
+	    run = 0;
+	} else {
+	    pos++;
+	    run++;
+	}
+	len = pos < end ? find_match (pk, pos, end, &dist) : 0;
+    }
+    add_token (pk, run, 0, 0);
+}
+
+/*
+ * Find the cheapest parse of the chunk for a cost model, taken first
+ * from rough guesses and then from the codes of the previous pass.
+ * The matches at each position are found once, beforehand; past a
+ * match of the nice length, positions are not searched.
+ */
+static void parse_optimal (packer *pk, long start, long end) {
+    unsigned long raw[NUM_SYMS], dist[NUM_SYMS], len[NUM_SYMS];
+    huf_table h;
+    cost_model cm;
+    long i, skip = start;
+    int s, pass;
+
+    for (i = start; i < end; i++) {
+	long *lens = pk->cand_len[i - start];
+	int n = 0;
+	if (i >= skip) {
+	    n = find_cands (pk, i, end, lens, pk->cand_dist[i - start]);
+	    if (n && lens[n-1] >= levels[pk->level].nice)
+		skip = i + lens[n-1];
+	}
+	pk->ncands[i - start] = n;
+    }
+
+    for (s = 0; s < NUM_SYMS; s++) {
+	cm.raw[s] = s ? 5 : 2;
+	cm.dist[s] = 4;
+	cm.len[s] = 3;
+    }
+    for (pass = 0; pass < 2; pass++) {
+	optimal_pass (pk, start, end, &cm);
+	count_tokens (pk, raw, dist, len);
+	build_table (&h, raw);
+	for (s = 0; s < NUM_SYMS; s++)
+	    cm.raw[s] = h.codelen[s] ? h.codelen[s] : MAX_CODELEN + 1;
+	build_table (&h, dist);
+	for (s = 0; s < NUM_SYMS; s++)
+	    cm.dist[s] = h.codelen[s] ? h.codelen[s] : MAX_CODELEN + 1;
+	build_table (&h, len);
+	for (s = 0; s < NUM_SYMS; s++)
+	    cm.len[s] = h.codelen[s] ? h.codelen[s] : MAX_CODELEN + 1;
+    }
+    optimal_pass (pk, start, end, &cm);
+}
+
+/*
+ * One shortest-path pass over the chunk. Literals cost 8 bits each,
+ * plus the code for the length of their run, which is only known
+ * once the run ends; at each position the run is either carried on
+ * or restarted after the best match ending there, whichever is
+ * cheaper so far.
+ */
+static void optimal_pass (packer *pk, long start, long end,
+			  const cost_model *cm) {
+    long n = end - start, i, j, k, l, base, cost, run;
+    long lbase = 0, lstart = 0;
+    int c;
+
+    for (i = 0; i <= n; i++)
+	pk->mcost[i] = INF;
+    pk->mcost[0] = 0;
+
+    for (i = 0; i <= n; i++) {
+	if (i > 0) {
+	    lbase += 8;
+	    if (pk->mcost[i] < INF
+		&& pk->mcost[i] + value_bits (cm->raw, 0)
+		   <= lbase + value_bits (cm->raw, i - lstart)) {
+		lbase = pk->mcost[i];
+		lstart = i;
+	    }
+	}
+	pk->litstart[i] = lstart;
+	pk->litcost[i] = lbase + value_bits (cm->raw, i - lstart);
+	if (i == n)
+	    break;
+
+	l = MIN_MATCH;
+	for (c = 0; c < pk->ncands[i]; c++) {
+	    long clen = pk->cand_len[i][c], cdist = pk->cand_dist[i][c];
+	    base = pk->litcost[i] + value_bits (cm->dist, cdist - 1);
+	    if (clen >= levels[pk->level].nice)
+		l = clen;
+	    for (; l <= clen; l++) {
+		cost = base + value_bits (cm->len, l - 2);
+		k = i + l;
+		if (cost < pk->mcost[k]) {
+		    pk->mcost[k] = cost;
+		    pk->mfrom[k] = i;
+		    pk->mlen[k] = l;
+		    pk->mdist[k] = cdist;
+		    pk->mrun[k] = lstart;
+		}
+	    }
+	}
+    }
+
+    /*
+     * Walk back from the end, then put the tokens in order.
+     */
+    pk->ntokens = 0;
+    j = pk->litstart[n];
+    add_token (pk, n - j, 0, 0);
+    while (j > 0) {
+	run = pk->mfrom[j] - pk->mrun[j];
+	add_token (pk, run, pk->mlen[j], pk->mdist[j]);
+	j = pk->mrun[j];
+    }
+    for (i = 0, k = pk->ntokens - 1; i < k; i++, k--) {
+	token t = pk->tokens[i];
+	pk->tokens[i] = pk->tokens[k];
+	pk->tokens[k] = t;
+    }
+}
+
+static void count_tokens (packer *pk, unsigned long *raw,
+			  unsigned long *dist, unsigned long *len) {
+    long i;
+
+    memset (raw, 0, NUM_SYMS * sizeof *raw);
+    memset (dist, 0, NUM_SYMS * sizeof *dist);
+    memset (len, 0, NUM_SYMS * sizeof *len);
+    for (i = 0; i < pk->ntokens; i++) {
+	token *t = &pk->tokens[i];
+	raw[value_sym (t->run)]++;
+	if (t->len) {
+	    dist[value_sym (t->dist - 1)]++;
+	    len[value_sym (t->len - 2)]++;
+	}
+    }
+}
+
+/*
+ * Write out the chunk starting at start, from the tokens: the three
+ * Huffman tables, the token count, then each literal run and match.
+ *
+ * After each match, the unpacker's input is at the end of the packed
+ * data written so far, so its leeway there is
+ *   (plen - in) - (ulen - out) = plen - ulen + (out - in),
+ * and the largest out - in is kept in lee_delta.
+ */
+static int emit_chunk (packer *pk, long start) {
+    unsigned long raw_freq[NUM_SYMS], dist_freq[NUM_SYMS];
+    unsigned long len_freq[NUM_SYMS];
+    huf_table raw, dist, len;
+    long i, out = start;
+
+    /* at most 30 bits for each value, plus the literals */
+    if (!reserve (pk, 64 + pk->ntokens * 12 + CHUNK_SZ))
+	return 0;
+
+    count_tokens (pk, raw_freq, dist_freq, len_freq);
+    build_table (&raw, raw_freq);
+    build_table (&dist, dist_freq);
+    build_table (&len, len_freq);
+    put_table (pk, &raw);
+    put_table (pk, &dist);
+    put_table (pk, &len);
+    put_bits (pk, pk->ntokens, 16);
+
+    for (i = 0; i < pk->ntokens; i++) {
+	token *t = &pk->tokens[i];
+	put_value (pk, &raw, t->run);
+	memcpy (pk->out + pk->pos, pk->data + out, t->run);
+	pk->pos += t->run;
+	out += t->run;
+	if (t->len) {
+	    put_value (pk, &dist, t->dist - 1);
+	    put_value (pk, &len, t->len - 2);
+	    out += t->len;
+	    if (pk->lee_delta < out - (pk->pos - 18))
+		pk->lee_delta = out - (pk->pos - 18);
+	}
+    }
+    return 1;
+}
+
+/*
+ * Make sure n more bytes of packed data fit.
+ */
+static int reserve (packer *pk, long n) {
+    unsigned char *out;
+    long sz;
+
+    if (pk->pos + n <= pk->out_sz)
+	return 1;
+    sz = pk->out_sz * 2 > pk->pos + n ? pk->out_sz * 2 : pk->pos + n;
+    out = realloc (pk->out, sz);
+    if (!out)
+	return 0;
+    pk->out = out;
+    pk->out_sz = sz;
+    return 1;
+}
+
+/*
+ * Build the canonical code the unpacker will derive from the code
+ * lengths, the same way it does.
+ */
+static void build_table (huf_table *h, const unsigned long *freq) {
+    unsigned long codeb = 0;
+    int i, j;
+
+    huf_lengths (freq, h->codelen);
+    h->num = 0;
+    for (j = 0; j < NUM_SYMS; j++)
+	if (h->codelen[j])
+	    h->num = j + 1;
+    for (i = 1; i <= MAX_CODELEN; i++) {
+	for (j = 0; j < h->num; j++)
+	    if (h->codelen[j] == i)
+		h->code[j] = mirror (codeb++, i);
+	codeb <<= 1;
+    }
+}
+
+/*
+ * Work out Huffman code lengths for the symbol frequencies. If some
+ * code would be too long, the frequencies are halved and it is done
+ * again.
+ */
+static void huf_lengths (const unsigned long *freq, int *codelen) {
+    unsigned long f[NUM_SYMS], weight[2 * NUM_SYMS];
+    int parent[2 * NUM_SYMS], active[2 * NUM_SYMS];
+    int i, j, a, b, nodes, left, depth, maxdepth;
+
+    for (i = 0; i < NUM_SYMS; i++)
+	f[i] = freq[i];
+    for (;;) {
+	nodes = NUM_SYMS;
+	left = 0;
+	for (i = 0; i < NUM_SYMS; i++) {
+	    weight[i] = f[i];
+	    active[i] = f[i] != 0;
+	    parent[i] = -1;
+	    codelen[i] = 0;
+	    left += active[i];
+	}
+	if (left == 1)
+	    for (i = 0; i < NUM_SYMS; i++)
+		if (active[i])
+		    codelen[i] = 1;
+	if (left <= 1)
+	    return;
+
+	while (left > 1) {
+	    a = b = -1;
+	    for (i = 0; i < nodes; i++) {
+		if (!active[i])
+		    continue;
+		if (a < 0 || weight[i] < weight[a]) {
+		    b = a;
+		    a = i;
+		} else if (b < 0 || weight[i] < weight[b])
+		    b = i;
+	    }
+	    weight[nodes] = weight[a] + weight[b];
+	    active[nodes] = 1;
+	    parent[nodes] = -1;
+	    parent[a] = parent[b] = nodes;
+	    active[a] = active[b] = 0;
+	    nodes++;
+	    left--;
+	}
+
+	maxdepth = 0;
+	for (i = 0; i < NUM_SYMS; i++) {
+	    if (!f[i])
+		continue;
+	    for (depth = 0, j = i; parent[j] >= 0; j = parent[j])
+		depth++;
+	    codelen[i] = depth;
+	    if (maxdepth < depth)
+		maxdepth = depth;
+	}
+	if (maxdepth <= MAX_CODELEN)
+	    return;
+	for (i = 0; i < NUM_SYMS; i++)
+	    if (f[i])
+		f[i] = (f[i] + 1) / 2;
+    }
+}
+
+static void put_table (packer *pk, huf_table *h) {
+    int i;
+
+    put_bits (pk, h->num, 5);
+    for (i = 0; i < h->num; i++)
+	put_bits (pk, h->codelen[i], 4);
+}
+
+/*
+ * Write a value as the code for its bit length, followed by the bits
+ * below its top bit, the way huf_read in dernc.c reads it back.
+ */
+static void put_value (packer *pk, huf_table *h, unsigned long n) {
+    int s = value_sym (n);
+
+    put_bits (pk, h->code[s], h->codelen[s]);
+    if (s >= 2)
+	put_bits (pk, n - (1UL << (s-1)), s-1);
+}
+
+/*
+ * Write bits into the packed data, lowest first. The bits go into
+ * 16-bit little-endian words; a new word is only started when a bit
+ * needs it, so literals written in between go before it, which is
+ * where the unpacker will look for them.
+ */
+static void put_bits (packer *pk, unsigned long v, int n) {
+    int take;
+
+    while (n > 0) {
+	if (pk->nbits == 16) {
+	    pk->wpos = pk->pos;
+	    pk->pos += 2;
+	    pk->val = 0;
+	    pk->nbits = 0;
+	}
+	take = 16 - pk->nbits;
+	if (take > n)
+	    take = n;
+	pk->val |= (v & ((1UL << take) - 1)) << pk->nbits;
+	pk->nbits += take;
+	v >>= take;
+	n -= take;
+	pk->out[pk->wpos] = pk->val & 0xFF;
+	pk->out[pk->wpos+1] = pk->val >> 8;
+    }
+}
+
+/*
+ * Return the symbol a value is coded with: its bit length.
+ */
+static int value_sym (unsigned long n) {
+    int s = 0;
+
+    while (n) {
+	s++;
+	n >>= 1;
+    }
+    return s;
+}
+
+/*
+ * Return how many bits a value takes with the given symbol costs.
+ */
+static int value_bits (const int *costs, unsigned long n) {
+    int s = value_sym (n);
+    return costs[s] + (s >= 2 ? s-1 : 0);
+}
+
+/*
+ * Store a big-endian longword at p.
+ */
+static void put_blong (unsigned char *p, unsigned long n) {
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+/*
+ * Store a big-endian word at p.
+ */
+static void put_bword (unsigned char *p, unsigned long n) {
+    p[0] = n >> 8;
+    p[1] = n;
+}
+
+/*
+ * Mirror the bottom n bits of x.
+ */
+static unsigned long mirror (unsigned long x, int n) {
+    unsigned long top = 1 << (n-1), bottom = 1;
+    while (top > bottom) {
+	unsigned long mask = top | bottom;
+	unsigned long masked = x & mask;
+	if (masked != 0 && masked != mask)
+	    x ^= mask;
+	top >>= 1;
+	bottom <<= 1;
+    }
+    return x;
+}
+
+#pragma GCC diagnostic pop
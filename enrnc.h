@@ -0,0 +1,20 @@
+/*
+ * enrnc.h   define exported routines from enrnc.c
+ */
+
+#ifndef RNC_ENRNC_H
+#define RNC_ENRNC_H
+
+/*
+ * Levels: greedy matching, lazy matching, and optimal parsing
+ */
+#define RNC_LEVEL_FAST 1
+#define RNC_LEVEL_LAZY 2
+#define RNC_LEVEL_BEST 3
+
+/*
+ * Routines
+ */
+long rnc_pack (void *unpacked, long ulen, void **packed, int level);
+
+#endif
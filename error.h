@@ -32,16 +32,23 @@
 	                        "out.gif relative to out.3ds, eg:\n\n"  \
 	                        "\tsilvie chr APPLE.CHR fixed.pal "     \
 	                        "out/apple.3ds out/apple.gif apple.gif")\
-	X(SLV_ERR_CHR_CHUNK_ID, "Unknown chunk identifier")             \
+	X(SLV_ERR_CHR_CHUNK_ID, "Unexpected chunk identifier")          \
 	X(SLV_ERR_CHR_CHUNK_SZ, "Chunk size mismatch")                  \
 	X(SLV_ERR_CHR_TEX, "Texture buffer size <= 8")                  \
+	X(SLV_ERR_CHR_TEX_RES, "Texture resolution mismatch")           \
 	X(SLV_ERR_CHR_GROUP_TYPE, "Unknown mesh group type")            \
 	X(SLV_ERR_CHR_MAT, "Unknown material")                          \
 	X(SLV_ERR_CHR_MESH_ID, "Unknown mesh id")                       \
+	X(SLV_ERR_CHR_MAT_OFF, "Unknown material offset")               \
+	X(SLV_ERR_CHR_VTX, "Unknown vertex")                            \
 	X(SLV_ERR_ENG_ARGS, EXP "silvie eng in.eng out.xml")            \
 	X(SLV_ERR_ENG_TOPIC, "Unknown topic")                           \
 	X(SLV_ERR_PAK_ARGS, EXP "silvie pak in.pak out.raw out0.bin "   \
-	                        "out1.bin out2.bin")                    \
+	                        "out1.bin out2.bin\n\n"                 \
+	                        "Any output may be - to skip it, and "  \
+	                        "out.raw may end in .gif for a GIF "    \
+	                        "file, eg:\n\n\t"                       \
+	                        "silvie pak LEVEL.PAK bg.gif - - -")    \
 	X(SLV_ERR_RAW_ARGS, EXP "silvie raw in.raw out.gif")            \
 	X(SLV_ERR_SPR_ARGS, EXP "silvie spr in.spr in.pal out.gif\n\n"  \
 	                        "Use $type and $index if in.spr "       \
@@ -52,9 +59,13 @@
 	X(SLV_ERR_SPR_FRAME, "Frame size mismatch")                     \
 	X(SLV_ERR_SPR_MASK, "Mask size mismatch")                       \
 	X(SLV_ERR_SPR_RES, "Frame resolution mismatch")                 \
+	X(SLV_ERR_SPR_STRIDE, "Stride past the end of a row")           \
+	X(SLV_ERR_SPR_ANIM, "Unknown animation frame")                  \
 	X(SLV_ERR_READ, "Error reading from stream")                    \
+	X(SLV_ERR_SEEK, "Error seeking in stream")                      \
 	X(SLV_ERR_OVERFLOW, "Overflow error")                           \
-	X(SLV_ERR_FILE_SZ, "File size mismatch")
+	X(SLV_ERR_FILE_SZ, "File size mismatch")                        \
+	X(SLV_ERR_LIST, "Only PAK files can be listed")
 
 enum slv_lib {
 	SLV_LIB_SLV,
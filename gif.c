@@ -20,9 +20,12 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "error.h"
 #include "gif.h"
 #include "utils.h"
+#include "writer.h"
 
 bool slv_read_pal(const char *path, struct GifColorType *colors,
                   struct slv_err *err)
@@ -44,13 +47,25 @@ close_pal:
 	return ret;
 }
 
+static int write_gif(struct GifFileType *gif, const GifByteType *buf, int sz)
+{
+	return slv_write_out(gif->UserData, buf, (size_t)sz) ? sz : 0;
+}
+
+/*
+ * The file is written in the background, and any error reported by the writer.
+ * It is not created at all if the GIF file cannot be set up.
+ */
 struct GifFileType *slv_open_gif(const struct slv_gif_opts *opts,
                                  struct slv_err *err)
 {
-	struct GifFileType *gif = EGifOpenFileName(opts->file_path, false,
-	                                           &err->code);
+	struct slv_out *out = slv_open_out(opts->writer, opts->file_path);
+	if (!out)
+		return NULL;
+	struct GifFileType *gif = EGifOpen(out, write_gif, &err->code);
 	if (!gif) {
 		err->lib = SLV_LIB_GIF;
+		slv_drop_out(out);
 		return NULL;
 	}
 	struct GifFileType *ret = NULL;
@@ -80,11 +95,20 @@ struct GifFileType *slv_open_gif(const struct slv_gif_opts *opts,
 free_map:
 	GifFreeMapObject(map);
 close_gif:
-	if (!ret)
+	if (!ret) {
 		EGifCloseFile(gif, NULL);
+		slv_drop_out(out);
+	}
 	return ret;
 }
 
+void slv_close_gif(struct GifFileType *gif)
+{
+	struct slv_out *out = gif->UserData;
+	EGifCloseFile(gif, NULL);
+	slv_close_out(out);
+}
+
 bool slv_fill_gif(struct GifFileType *gif, const struct slv_gif_buf_info *info,
                   struct slv_err *err)
 {
@@ -105,9 +129,19 @@ bool slv_fill_gif(struct GifFileType *gif, const struct slv_gif_buf_info *info,
 	if (!EGifPutImageDesc(gif, info->left, info->top, info->width,
 	                      info->height, false, NULL))
 		goto set_err;
-	for (int i = 0; i < info->height; ++i)
-		if (!EGifPutLine(gif, &info->buf[i * info->width], info->width))
+	// EGifPutLine() masks lines in place, while the buffer may be read-only
+	size_t width = (size_t)info->width;
+	GifPixelType *line = slv_malloc(width, err);
+	if (!line)
+		return false;
+	for (int i = 0; i < info->height; ++i) {
+		memcpy(line, &info->buf[(size_t)i * width], width);
+		if (!EGifPutLine(gif, line, info->width)) {
+			free(line);
 			goto set_err;
+		}
+	}
+	free(line);
 	return true;
 set_err:
 	slv_set_err(err, SLV_LIB_GIF, gif->Error);
@@ -24,8 +24,10 @@
 struct GifColorType;
 struct GifFileType;
 struct slv_err;
+struct slv_writer;
 
 struct slv_gif_opts {
+	struct slv_writer *writer;
 	const char *file_path;
 	int num_colors;
 	const struct GifColorType *colors;
@@ -39,7 +41,7 @@ struct slv_gif_buf_info {
 	int top;
 	int width;
 	int height;
-	unsigned char *buf;
+	const unsigned char *buf;
 	bool alpha;
 	int disposal;
 	int delay;
@@ -51,6 +53,7 @@ bool slv_read_pal(const char *path, struct GifColorType *colors,
                   struct slv_err *err);
 struct GifFileType *slv_open_gif(const struct slv_gif_opts *opts,
                                  struct slv_err *err);
+void slv_close_gif(struct GifFileType *gif);
 bool slv_fill_gif(struct GifFileType *gif, const struct slv_gif_buf_info *info,
                   struct slv_err *err);
 
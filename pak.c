@@ -16,16 +16,23 @@
  * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include "asset.h"
 #include "dernc.h"
 #include "error.h"
 #include "pak.h"
+#include "raw.h"
 #include "stream.h"
 #include "utils.h"
+#include "writer.h"
 
 static bool check_args(const void *me)
 {
@@ -37,134 +44,404 @@ struct rnc_hdr {
 	unsigned char method;
 	unsigned long unpacked_sz;
 	unsigned long packed_sz;
+	unsigned char crcs[4];
+	unsigned char leeway_and_chunks[2];
+};
+
+/*
+ * The unpacked data is decoded as it is read, so that only a window of it and
+ * a small buffer of packed data are ever held in memory
+ */
+struct unrnc {
+	struct slv_stream stream;
+	struct slv_stream *packed;
+	rnc_stream *rnc;
+	unsigned long unpacked_sz;
+	unsigned long packed_sz;
 };
 
-static bool load(void *me, struct slv_stream *rnc_stream)
+static long read_packed(void *ctx, void *buf, long len)
+{
+	return slv_read_buf(ctx, buf, (size_t)len) ? len : -1;
+}
+
+// Errors reading the packed data have already been set by the packed stream
+static bool set_rnc_err(struct slv_err *err, long rnc_code)
+{
+	if (rnc_code != RNC_INPUT_ERROR) {
+		err->lib = SLV_LIB_RNC;
+		err->rnc_code = rnc_code;
+	}
+	return false;
+}
+
+static bool read_rnc_hdr(struct slv_stream *stream, struct rnc_hdr *hdr)
 {
-	size_t hdr_sz = 18;
-	unsigned char *packed = slv_malloc(hdr_sz, rnc_stream->err);
-	if (!packed)
+	if (!slv_read_buf(stream, &hdr->magic[0], sizeof hdr->magic)
+	    || !slv_read_buf(stream, &hdr->method, 1)
+	    || !slv_read_be(stream, &hdr->unpacked_sz)
+	    || !slv_read_be(stream, &hdr->packed_sz)
+	    || !slv_read_buf(stream, hdr->crcs, sizeof hdr->crcs)
+	    || !slv_read_buf(stream, hdr->leeway_and_chunks,
+	                     sizeof hdr->leeway_and_chunks))
 		return false;
-	bool ret = false;
-	struct slv_stream *hdr_stream;
-	if (!slv_read_buf(rnc_stream, packed, hdr_sz)
-	    || !(hdr_stream = slv_new_ms(packed, hdr_sz, rnc_stream->err)))
-		goto free_packed;
-	struct rnc_hdr hdr;
-	if (!slv_read_buf(hdr_stream, &hdr.magic[0], sizeof hdr.magic)
-	    || !slv_read_buf(hdr_stream, &hdr.method, 1)
-	    || !slv_read_be(hdr_stream, &hdr.unpacked_sz)
-	    || !slv_read_be(hdr_stream, &hdr.packed_sz))
-		goto del_hdr_stream;
-	size_t pak_sz = hdr_sz + hdr.packed_sz;
-	// The RNC library needs 8 extra bytes for packed and unpacked buffers
-	unsigned char *tmp = slv_realloc(packed, pak_sz + 8, rnc_stream->err);
-	if (!tmp)
-		goto del_hdr_stream;
-	packed = tmp;
-	unsigned char *unpacked;
-	size_t unpacked_sz = hdr.unpacked_sz;
-	if (!slv_read_buf(rnc_stream, &packed[hdr_sz], hdr.packed_sz)
-	    || !(unpacked = slv_malloc(unpacked_sz + 8, rnc_stream->err)))
-		goto del_hdr_stream;
-	long rnc_ret = rnc_unpack(packed, unpacked);
+	if (memcmp(hdr->magic, "RNC", sizeof hdr->magic) || hdr->method != 1)
+		return set_rnc_err(stream->err, RNC_FILE_IS_NOT_RNC);
+	return true;
+}
+
+static bool unrnc_read(void *me, void *buf, size_t sz)
+{
+	struct unrnc *unrnc = me;
+	long rnc_ret = rnc_read(unrnc->rnc, buf, (long)sz);
+	if (rnc_ret < 0)
+		return set_rnc_err(unrnc->stream.err, rnc_ret);
+	if ((size_t)rnc_ret != sz) {
+		slv_set_err(unrnc->stream.err, SLV_LIB_SLV, SLV_ERR_READ);
+		return false;
+	}
+	unrnc->stream.pos += sz;
+	return true;
+}
+
+// Only forward, by decoding the bytes in between without copying them
+static bool unrnc_seek(void *me, size_t pos)
+{
+	struct unrnc *unrnc = me;
+	if (pos < unrnc->stream.pos || pos - unrnc->stream.pos > LONG_MAX) {
+		slv_set_err(unrnc->stream.err, SLV_LIB_SLV, SLV_ERR_SEEK);
+		return false;
+	}
+	long sz = (long)(pos - unrnc->stream.pos);
+	long rnc_ret = rnc_skip(unrnc->rnc, sz);
+	if (rnc_ret < 0)
+		return set_rnc_err(unrnc->stream.err, rnc_ret);
+	if (rnc_ret != sz) {
+		slv_set_err(unrnc->stream.err, SLV_LIB_SLV, SLV_ERR_READ);
+		return false;
+	}
+	unrnc->stream.pos = pos;
+	return true;
+}
+
+static void unrnc_del(void *me)
+{
+	struct unrnc *unrnc = me;
+	rnc_close(unrnc->rnc);
+	free(unrnc);
+}
+
+static const struct slv_stream_ops unrnc_ops = {
+	.read = unrnc_read,
+	.seek = unrnc_seek,
+	.del = unrnc_del,
+};
+
+static struct slv_stream *new_unrnc(struct slv_stream *packed)
+{
+	struct unrnc *unrnc = slv_malloc(sizeof *unrnc, packed->err);
+	if (!unrnc)
+		return NULL;
+	long rnc_ret = rnc_open(&unrnc->rnc, read_packed, packed);
 	if (rnc_ret < 0) {
-		rnc_stream->err->lib = SLV_LIB_RNC;
-		rnc_stream->err->rnc_code = rnc_ret;
-		goto free_unpacked;
+		set_rnc_err(packed->err, rnc_ret);
+		free(unrnc);
+		return NULL;
 	}
-	struct slv_stream *stream;
-	if (!(stream = slv_new_ms(unpacked, unpacked_sz, rnc_stream->err)))
-		goto free_unpacked;
+	unrnc->stream = (struct slv_stream) {
+		.ops = &unrnc_ops,
+		.err = packed->err,
+	};
+	unrnc->packed = packed;
+	unrnc->unpacked_sz = (unsigned long)rnc_ret;
+	unrnc->packed_sz = (unsigned long)rnc_packed_len(unrnc->rnc);
+	return &unrnc->stream;
+}
+
+// Decodes whatever follows the sections, so that the CRCs get checked
+static bool finish_unrnc(struct slv_stream *stream)
+{
+	struct unrnc *unrnc = (struct unrnc *)stream;
+	long rnc_ret = rnc_skip(unrnc->rnc, LONG_MAX);
+	slv_merge_stats(unrnc->packed, stream);
+	return rnc_ret >= 0 || set_rnc_err(stream->err, rnc_ret);
+}
+
+// The sections are only decoded by save, which streams them to their files
+static bool load(void *me, struct slv_stream *packed)
+{
 	struct slv_pak *pak = me;
-	if (!slv_read_le(stream, &pak->raw_hdr_sz)
-	    || !slv_read_buf(stream, pak->raw_hdr, sizeof pak->raw_hdr)
-	    || !slv_read_le(stream, &pak->raw_pal_sz)
-	    || !slv_read_buf(stream, pak->raw_pal, sizeof pak->raw_pal)
-	    || !slv_read_le(stream, &pak->raw_buf_sz)
-	    || !(pak->raw_buf = slv_malloc(pak->raw_buf_sz, stream->err))
-	    || !slv_read_buf(stream, pak->raw_buf, pak->raw_buf_sz)
-	    || !slv_read_le(stream, &pak->out_0_sz)
-	    || !(pak->out_0_buf = slv_malloc(pak->out_0_sz, stream->err))
-	    || !slv_read_buf(stream, pak->out_0_buf, pak->out_0_sz)
-	    || !slv_read_le(stream, &pak->out_1_sz)
-	    || !(pak->out_1_buf = slv_malloc(pak->out_1_sz, stream->err))
-	    || !slv_read_buf(stream, pak->out_1_buf, pak->out_1_sz)
-	    || !slv_read_le(stream, &pak->out_2_hdr_sz)
-	    || !slv_read_buf(stream, pak->out_2_hdr, sizeof pak->out_2_hdr)
-	    || !slv_read_le(stream, &pak->out_2_buf_sz)
-	    || !(pak->out_2_buf = slv_malloc(pak->out_2_buf_sz, stream->err))
-	    || !slv_read_buf(stream, pak->out_2_buf, pak->out_2_buf_sz))
-		goto del_stream;
+	struct slv_stream *stream = new_unrnc(packed);
+	if (!stream)
+		return false;
+	pak->unpacked = stream;
+	return slv_read_le(stream, &pak->raw_hdr_sz)
+	       && slv_read_buf(stream, pak->raw_hdr, sizeof pak->raw_hdr)
+	       && slv_read_le(stream, &pak->raw_pal_sz)
+	       && slv_read_buf(stream, pak->raw_pal, sizeof pak->raw_pal);
+}
+
+#define OUT_2_HDR_SZ 112
+
+struct piece {
+	const void *buf;
+	size_t sz;
+};
+
+// The section is read out of the decoder's window into the writer's blocks
+static bool save_section(struct slv_stream *stream, struct slv_out *out)
+{
+	unsigned long sz;
+	if (!slv_read_le(stream, &sz))
+		return false;
+	while (sz) {
+		size_t room;
+		void *buf = slv_reserve_out(out, &room);
+		if (!buf)
+			return false;
+		if (room > sz)
+			room = sz;
+		if (!slv_read_buf(stream, buf, room)
+		    || !slv_commit_out(out, room))
+			return false;
+		sz -= room;
+	}
+	return true;
+}
+
+// Skipped sections are decoded through the window but never copied out
+static bool skip_section(struct slv_stream *stream)
+{
+	unsigned long sz;
+	return slv_read_le(stream, &sz) && slv_skip(stream, sz, 1);
+}
+
+// The pieces given are written first, joined to the section
+static bool save_file(const char *path, struct slv_stream *stream,
+                      const struct piece *pieces, size_t num_pieces,
+                      const struct slv_asset *asset)
+{
+	if (!strcmp(path, "-"))
+		return skip_section(stream);
+	struct slv_out *out = slv_open_out(asset->writer, path);
+	if (!out)
+		return false;
+	bool ret = false;
+	for (size_t i = 0; i < num_pieces; ++i)
+		if (!slv_write_out(out, pieces[i].buf, pieces[i].sz))
+			goto close_out;
+	if (!save_section(stream, out))
+		goto close_out;
 	ret = true;
-del_stream:
-	SLV_DEL(stream);
-free_unpacked:
-	free(unpacked);
-del_hdr_stream:
-	SLV_DEL(hdr_stream);
-free_packed:
-	free(packed);
-	return ret;
+close_out:
+	return slv_close_out(out) && ret;
 }
 
-static bool save_file(const char *path, const unsigned char *buf, size_t sz,
-                      struct slv_err *err)
+// BG.GIF is as much a GIF file as bg.gif
+static bool is_gif(const char *path)
 {
-	FILE *file = slv_fopen(path, "wb", err);
-	if (!file)
+	size_t len = strlen(path);
+	return len >= 4 && !strcasecmp(&path[len - 4], ".gif");
+}
+
+/*
+ * The RAW image goes to raw.c as the raw format would load it: header, palette
+ * and as many pixels as the header gives, the rest of the section being skipped
+ */
+static bool save_gif(const struct slv_pak *pak, const char *path,
+                     struct slv_stream *stream, struct slv_err *err)
+{
+	char *args[] = {NULL, (char *)path, NULL};
+	struct slv_raw *raw = (struct slv_raw *)slv_new_raw(args, err);
+	if (!raw)
 		return false;
 	bool ret = false;
-	if (!slv_fwrite(buf, sz, 1, file, err))
-		goto close_file;
+	struct slv_stream *hdr = slv_new_ms(pak->raw_hdr, sizeof pak->raw_hdr,
+	                                    err);
+	if (!hdr)
+		goto del_raw;
+	bool hdr_read = slv_read_raw_hdr(hdr, &raw->hdr);
+	SLV_DEL(hdr);
+	unsigned long sz;
+	if (!hdr_read || !slv_read_le(stream, &sz))
+		goto del_raw;
+	if (raw->hdr.buf_sz > sz) {
+		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_FILE_SZ);
+		goto del_raw;
+	}
+	memcpy(raw->colors, pak->raw_pal, sizeof raw->colors);
+	raw->asset.writer = pak->asset.writer;
+	if (!(raw->buf = slv_malloc(raw->hdr.buf_sz, err))
+	    || !slv_read_buf(stream, raw->buf, raw->hdr.buf_sz)
+	    || !slv_skip(stream, sz - raw->hdr.buf_sz, 1)
+	    || !SLV_CALL(save, &raw->asset))
+		goto del_raw;
 	ret = true;
-close_file:
-	fclose(file);
+del_raw:
+	SLV_DEL(&raw->asset);
 	return ret;
 }
 
+struct sections {
+	unsigned long raw_hdr_sz;
+	struct slv_raw_hdr raw_hdr;
+	unsigned long raw_pal_sz;
+	unsigned long raw_sz;
+	unsigned long out_0_sz;
+	unsigned long out_1_sz;
+	unsigned long out_2_hdr_sz;
+	unsigned long out_2_sz;
+};
+
+// Reads the sizes of the sections, stopping at that of the last one
+static bool read_sections(struct slv_stream *stream, struct sections *secs)
+{
+	return slv_read_le(stream, &secs->raw_hdr_sz)
+	       && slv_read_raw_hdr(stream, &secs->raw_hdr)
+	       && slv_read_le(stream, &secs->raw_pal_sz)
+	       && slv_skip(stream, 3 * SLV_NUM_RAW_COLORS, 1)
+	       && slv_read_le(stream, &secs->raw_sz)
+	       && slv_skip(stream, secs->raw_sz, 1)
+	       && slv_read_le(stream, &secs->out_0_sz)
+	       && slv_skip(stream, secs->out_0_sz, 1)
+	       && slv_read_le(stream, &secs->out_1_sz)
+	       && slv_skip(stream, secs->out_1_sz, 1)
+	       && slv_read_le(stream, &secs->out_2_hdr_sz)
+	       && slv_skip(stream, OUT_2_HDR_SZ, 1)
+	       && slv_read_le(stream, &secs->out_2_sz);
+}
+
+/*
+ * The data is decoded as save would, through the window and without being
+ * copied out, so that the section sizes and both CRCs are checked
+ */
+static bool validate(const void *me, struct slv_stream *packed)
+{
+	(void)me;
+	struct slv_stream *stream = new_unrnc(packed);
+	if (!stream)
+		return false;
+	bool ret = false;
+	struct sections secs;
+	if (!read_sections(stream, &secs))
+		goto del_stream;
+	if (secs.raw_hdr.buf_sz > secs.raw_sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_FILE_SZ);
+		goto del_stream;
+	}
+	ret = slv_skip(stream, secs.out_2_sz, 1) && finish_unrnc(stream);
+del_stream:
+	SLV_DEL(stream);
+	return ret;
+}
+
+static void print_json_str(const char *str)
+{
+	putchar('"');
+	for (; *str; ++str) {
+		unsigned char ch = (unsigned char)*str;
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+/*
+ * Prints the sizes as one line of JSON. Only the RNC header is read when that
+ * is all that is asked for; otherwise decoding stops at the size of the last
+ * section, so the CRCs are only checked if that is the end of the data.
+ */
+static bool list(void *me, struct slv_stream *packed, bool hdr_only)
+{
+	struct slv_pak *pak = me;
+	struct rnc_hdr hdr;
+	if (hdr_only) {
+		if (!read_rnc_hdr(packed, &hdr))
+			return false;
+		fputs("{\"path\":", stdout);
+		print_json_str(pak->asset.args[0]);
+		printf(",\"unpacked_sz\":%lu,\"packed_sz\":%lu}\n",
+		       hdr.unpacked_sz, hdr.packed_sz);
+		return true;
+	}
+	struct slv_stream *stream = new_unrnc(packed);
+	if (!stream)
+		return false;
+	pak->unpacked = stream;
+	struct sections secs;
+	if (!read_sections(stream, &secs))
+		return false;
+	struct unrnc *unrnc = (struct unrnc *)stream;
+	slv_merge_stats(packed, stream);
+	fputs("{\"path\":", stdout);
+	print_json_str(pak->asset.args[0]);
+	printf(",\"unpacked_sz\":%lu,\"packed_sz\":%lu,\"raw_hdr\":{",
+	       unrnc->unpacked_sz, unrnc->packed_sz);
+	const char *sep = "";
+#define X(field) \
+	printf("%s\"" #field "\":%lld", sep, (long long)secs.raw_hdr.field); \
+	sep = ",";
+	SLV_RAW_HDR_FIELDS(X)
+#undef X
+	printf("},\"raw_hdr_sz\":%lu,\"raw_pal_sz\":%lu,\"raw_sz\":%lu,"
+	       "\"out_0_sz\":%lu,\"out_1_sz\":%lu,\"out_2_hdr_sz\":%lu,"
+	       "\"out_2_sz\":%lu}\n", secs.raw_hdr_sz, secs.raw_pal_sz,
+	       secs.raw_sz, secs.out_0_sz, secs.out_1_sz, secs.out_2_hdr_sz,
+	       secs.out_2_sz);
+	return true;
+}
+
+/*
+ * The RAW header and palette are written ahead of the pixels, or the image is
+ * converted straight away if a GIF file is asked for instead. Corrupt data is
+ * only found as it is decoded, so the files written until then are removed.
+ */
 static bool save(const void *me)
 {
 	const struct slv_pak *pak = me;
 	struct slv_err *err = pak->asset.err;
 	char **args = pak->asset.args;
-	FILE *bg = slv_fopen(args[1], "wb", err);
-	if (!bg)
-		return false;
-	bool ret = false;
-	FILE *out_2 = slv_fopen(args[4], "wb", err);
-	if (!out_2)
-		goto close_bg;
-	if (!slv_fwrite(pak->raw_hdr, sizeof pak->raw_hdr, 1, bg, err)
-	    || !slv_fwrite(pak->raw_pal, sizeof pak->raw_pal, 1, bg, err)
-	    || !slv_fwrite(pak->raw_buf, pak->raw_buf_sz, 1, bg, err)
-	    || !save_file(args[2], pak->out_0_buf, pak->out_0_sz, err)
-	    || !save_file(args[3], pak->out_1_buf, pak->out_1_sz, err)
-	    || !slv_fwrite(pak->out_2_hdr, sizeof pak->out_2_hdr, 1, out_2, err)
-	    || !slv_fwrite(pak->out_2_buf, pak->out_2_buf_sz, 1, out_2, err))
-		goto close_out_2;
-	ret = true;
-close_out_2:
-	fclose(out_2);
-close_bg:
-	fclose(bg);
+	const struct slv_asset *asset = &pak->asset;
+	struct slv_stream *stream = pak->unpacked;
+	const struct piece raw[] = {
+		{pak->raw_hdr, sizeof pak->raw_hdr},
+		{pak->raw_pal, sizeof pak->raw_pal},
+	};
+	unsigned long out_2_hdr_sz;
+	unsigned char out_2_hdr[OUT_2_HDR_SZ];
+	const struct piece out_2[] = {{out_2_hdr, sizeof out_2_hdr}};
+	bool ret = (is_gif(args[1])
+	            ? save_gif(pak, args[1], stream, err)
+	            : save_file(args[1], stream, raw, 2, asset))
+	           && save_file(args[2], stream, NULL, 0, asset)
+	           && save_file(args[3], stream, NULL, 0, asset)
+	           && slv_read_le(stream, &out_2_hdr_sz)
+	           && slv_read_buf(stream, out_2_hdr, sizeof out_2_hdr)
+	           && save_file(args[4], stream, out_2, 1, asset)
+	           && finish_unrnc(stream);
+	if (!ret)
+		slv_discard_writer(asset->writer);
 	return ret;
 }
 
 static void del(void *me)
 {
 	struct slv_pak *pak = me;
-	free(pak->raw_buf);
-	free(pak->out_0_buf);
-	free(pak->out_1_buf);
-	free(pak->out_2_buf);
+	if (pak->unpacked)
+		SLV_DEL(pak->unpacked);
 	free(pak);
 }
 
 static const struct slv_asset_ops ops = {
 	.check_args = check_args,
 	.load = load,
+	.validate = validate,
 	.save = save,
+	.list = list,
 	.del = del,
 };
 
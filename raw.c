@@ -27,6 +27,18 @@
 #include "stream.h"
 #include "utils.h"
 
+static const struct slv_field hdr_fields[] = {
+#define X(field) SLV_FIELD(struct slv_raw_hdr, field),
+	SLV_RAW_HDR_FIELDS(X)
+#undef X
+};
+
+// Also used for the RAW header stored at the start of PAK files
+bool slv_read_raw_hdr(struct slv_stream *stream, struct slv_raw_hdr *hdr)
+{
+	return slv_read_fields(stream, hdr_fields, SLV_LEN(hdr_fields), hdr);
+}
+
 static bool check_args(const void *me)
 {
 	return slv_check_args(me, 2, SLV_ERR_RAW_ARGS);
@@ -36,22 +48,21 @@ static bool load(void *me, struct slv_stream *stream)
 {
 	struct slv_raw *raw = me;
 	struct slv_raw_hdr *hdr = &raw->hdr;
-	return slv_read_le(stream, &hdr->cst_0)
-	       && slv_read_le(stream, &hdr->width_0)
-	       && slv_read_le(stream, &hdr->height)
-	       && slv_read_le(stream, &hdr->cst_1)
-	       && slv_read_le(stream, &hdr->buf_sz)
+	return slv_read_raw_hdr(stream, hdr)
 	       && (raw->buf = slv_malloc(hdr->buf_sz, stream->err))
-	       && slv_read_le(stream, &hdr->width_1)
-	       && slv_read_le(stream, &hdr->unk_0)
-	       && slv_read_le(stream, &hdr->unk_1)
-	       && slv_read_le(stream, &hdr->unk_2)
-	       && slv_read_le(stream, &hdr->unk_3)
-	       && slv_read_le(stream, &hdr->unk_4)
 	       && slv_read_buf(stream, raw->colors, sizeof raw->colors)
 	       && slv_read_buf(stream, raw->buf, hdr->buf_sz);
 }
 
+static bool validate(const void *me, struct slv_stream *stream)
+{
+	(void)me;
+	struct slv_raw_hdr hdr;
+	return slv_read_raw_hdr(stream, &hdr)
+	       && slv_skip(stream, 3 * SLV_NUM_RAW_COLORS, 1)
+	       && slv_skip(stream, hdr.buf_sz, 1);
+}
+
 static bool save(const void *me)
 {
 	const struct slv_raw *raw = me;
@@ -69,6 +80,7 @@ static bool save(const void *me)
 	    || !slv_ul_to_i(hdr->height, &height, raw->asset.err))
 		return false;
 	struct GifFileType *gif = slv_open_gif(&(struct slv_gif_opts) {
+		.writer = raw->asset.writer,
 		.file_path = raw->asset.out,
 		.num_colors = SLV_NUM_RAW_COLORS,
 		.colors = colors,
@@ -86,7 +98,7 @@ static bool save(const void *me)
 		goto close_gif;
 	ret = true;
 close_gif:
-	EGifCloseFile(gif, NULL);
+	slv_close_gif(gif);
 	return ret;
 }
 
@@ -100,6 +112,7 @@ static void del(void *me)
 static const struct slv_asset_ops ops = {
 	.check_args = check_args,
 	.load = load,
+	.validate = validate,
 	.save = save,
 	.del = del,
 };
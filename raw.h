@@ -19,9 +19,24 @@
 #ifndef SLV_RAW_H
 #define SLV_RAW_H
 
+#include <stdbool.h>
 #include "asset.h"
 
 struct slv_err;
+struct slv_stream;
+
+#define SLV_RAW_HDR_FIELDS(X) \
+	X(cst_0)        \
+	X(width_0)      \
+	X(height)       \
+	X(cst_1)        \
+	X(buf_sz)       \
+	X(width_1)      \
+	X(unk_0)        \
+	X(unk_1)        \
+	X(unk_2)        \
+	X(unk_3)        \
+	X(unk_4)
 
 struct slv_raw_hdr {
 	unsigned long cst_0;
@@ -46,6 +61,7 @@ struct slv_raw {
 	unsigned char *buf;
 };
 
+bool slv_read_raw_hdr(struct slv_stream *stream, struct slv_raw_hdr *hdr);
 struct slv_asset *slv_new_raw(char **args, struct slv_err *err);
 
 #endif // SLV_RAW_H
@@ -16,7 +16,9 @@
  * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,18 +31,379 @@
 #include "spr.h"
 #include "stream.h"
 #include "utils.h"
+#include "writer.h"
 
-static bool process(struct slv_asset *asset)
+enum list_mode {
+	LIST_NONE,
+	LIST_SECTIONS,
+	LIST_HEADER,
+};
+
+struct opts {
+	size_t buf_sz;
+	bool io_stats;
+	bool check;
+	enum list_mode list;
+};
+
+// Outputs are written in the background until the writer is flushed
+static bool save(struct slv_asset *asset)
+{
+	if (!(asset->writer = slv_new_writer(asset->err)))
+		return false;
+	bool ret = SLV_CALL(save, asset) && slv_flush_writer(asset->writer);
+	slv_del_writer(asset->writer);
+	asset->writer = NULL;
+	return ret;
+}
+
+#ifdef TEST_CHECK
+#define TEST_WIDTH 4
+#define TEST_HEIGHT 3
+#define TEST_PAL "checktest.pal"
+#define TEST_GIF "checktest.gif"
+#define TEST_3DS "checktest.3ds"
+
+struct test_buf {
+	unsigned char bytes[1024];
+	size_t sz;
+};
+
+static void put(struct test_buf *buf, unsigned long val, size_t sz)
+{
+	for (size_t i = 0; i < sz; ++i)
+		buf->bytes[buf->sz++] = (unsigned char)(val >> 8 * i);
+}
+
+static void put_buf(struct test_buf *buf, const struct test_buf *data)
+{
+	memcpy(&buf->bytes[buf->sz], data->bytes, data->sz);
+	buf->sz += data->sz;
+}
+
+// Chunk sizes are filled in by end_chunk, once their contents are known
+static size_t begin_chunk(struct test_buf *buf, unsigned long id)
+{
+	put(buf, id, 4);
+	put(buf, 0, 4);
+	return buf->sz;
+}
+
+static void end_chunk(struct test_buf *buf, size_t start)
+{
+	size_t end = buf->sz;
+	buf->sz = start - 4;
+	put(buf, end - start, 4);
+	buf->sz = end;
+}
+
+// Every row is 2 transparent pixels, then 2 plain ones
+static void make_frame(struct test_buf *frame, unsigned long format)
+{
+	frame->sz = 0;
+	switch (format) {
+	case SLV_SPR_RLE:
+		put(frame, TEST_WIDTH, 2);
+		put(frame, TEST_HEIGHT, 2);
+		for (size_t i = 0; i < TEST_HEIGHT; ++i) {
+			put(frame, 4, 2);
+			put(frame, 0xfe, 1);
+			put(frame, 2, 1);
+			put(frame, 0x2a, 2);
+		}
+		return;
+	case SLV_SPR_HAS_MASKS:
+		put(frame, 2 + 4 * TEST_HEIGHT, 2);
+		for (size_t i = 0; i < TEST_HEIGHT; ++i) {
+			put(frame, 2, 2);
+			put(frame, 0xfe, 1);
+			put(frame, 2, 1);
+		}
+		break;
+	}
+	// Plain pixels follow the masks
+	for (size_t i = 0; i < TEST_HEIGHT; ++i)
+		put(frame, 0x2a2a2a2a, TEST_WIDTH);
+}
+
+// Two frames, and an animation showing both
+static void make_spr(struct test_buf *buf, unsigned long format)
+{
+	struct test_buf frame;
+	make_frame(&frame, format);
+	buf->sz = 0;
+	put(buf, 0, 4); // File size, once known
+	put(buf, 1, 4);
+	put(buf, format, 4);
+	put(buf, 2, 4);
+	put(buf, 0, 4);
+	put(buf, 1, 4);
+	put(buf, 0, 4);
+	for (size_t i = 0; i < 2; ++i) {
+		put(buf, frame.sz, 4);
+		put(buf, TEST_WIDTH, 4);
+		put(buf, TEST_HEIGHT, 4);
+		put(buf, i, 4);
+		put(buf, i, 4);
+	}
+	put(buf, 0, 4);
+	const unsigned long anim[] = {2, 10, 2, 0, 0, 0, 1};
+	for (size_t i = 0; i < SLV_LEN(anim); ++i)
+		put(buf, anim[i], 4);
+	for (size_t i = 0; i < 2; ++i) {
+		put(buf, frame.sz, 4);
+		put_buf(buf, &frame);
+	}
+	size_t sz = buf->sz;
+	buf->sz = 0;
+	put(buf, sz - 4, 4);
+	buf->sz = sz;
+}
+
+// A square split in two triangles, one as a quad and one colored by index
+static void make_mesh(struct test_buf *buf)
+{
+	const unsigned long fields[] = {0, 7, 0, 4, 2, 2, 0, 0};
+	for (size_t i = 0; i < SLV_LEN(fields); ++i)
+		put(buf, fields[i], 4);
+	for (size_t i = 0; i < 3 + 16; ++i)
+		put(buf, 0, 4);
+	const unsigned long one = 0x3f800000;
+	const unsigned long vertices[] = {
+		0, 0, 0, one, 0, 0, one, one, 0, 0, one, 0,
+	};
+	for (size_t i = 0; i < SLV_LEN(vertices); ++i)
+		put(buf, vertices[i], 4);
+	for (size_t i = 0; i < 3 * 2; ++i)
+		put(buf, i % 3 == 2 ? one : 0, 4);
+	put(buf, 0, 1);
+	put(buf, 0, 1);
+	put(buf, 4, 1);
+	put(buf, 0, 1);
+	put(buf, 0, 4);
+	for (size_t i = 0; i < 4; ++i) {
+		put(buf, i, 4);
+		put(buf, 0, 4);
+		put(buf, 0, 2);
+		put(buf, i & 1, 2);
+		put(buf, 0, 2);
+		put(buf, i >> 1, 2);
+	}
+	put(buf, SLV_CHR_COLOR_IDX, 1);
+	put(buf, 1, 1);
+	put(buf, 3, 1);
+	put(buf, 0, 1);
+	put(buf, 0, 4);
+	for (size_t i = 0; i < 3; ++i) {
+		put(buf, i, 4);
+		put(buf, 0, 4);
+		put(buf, i, 2);
+		put(buf, 0, 2);
+		put(buf, 0, 2);
+		put(buf, 0, 2);
+	}
+}
+
+static void make_chr(struct test_buf *buf)
+{
+	buf->sz = 0;
+	size_t file = begin_chunk(buf, 0x8000);
+	size_t root = begin_chunk(buf, 0x8001);
+	size_t chunk = begin_chunk(buf, 0x7f01);
+	put(buf, 1, 4);
+	put(buf, TEST_WIDTH, 4);
+	end_chunk(buf, chunk);
+	chunk = begin_chunk(buf, 0x7f03);
+	put(buf, 1, 4);
+	put(buf, 7, 4);
+	size_t mesh = begin_chunk(buf, 0x7f02);
+	make_mesh(buf);
+	end_chunk(buf, mesh);
+	end_chunk(buf, chunk);
+	chunk = begin_chunk(buf, 0x7f04);
+	const unsigned long tex[] = {
+		1, TEST_WIDTH, TEST_HEIGHT, 2, TEST_WIDTH * TEST_HEIGHT,
+		TEST_WIDTH, 0, 0, 0, 0, 0, 0,
+	};
+	for (size_t i = 0; i < SLV_LEN(tex); ++i)
+		put(buf, tex[i], 4);
+	for (size_t i = 0; i < TEST_HEIGHT; ++i)
+		put(buf, 0, 4);
+	for (size_t i = 0; i < TEST_WIDTH * TEST_HEIGHT - 8; ++i)
+		put(buf, i, 1);
+	end_chunk(buf, chunk);
+	chunk = begin_chunk(buf, 0x7f05);
+	put(buf, 0, 4);
+	put(buf, 1, 4);
+	put(buf, (unsigned long)-1, 4);
+	for (size_t i = 0; i < 3; ++i)
+		put(buf, 0, 4);
+	end_chunk(buf, chunk);
+	chunk = begin_chunk(buf, 0x7f06);
+	put(buf, SLV_CHR_GROUP_TYPE_SINGLE, 4);
+	put(buf, 7, 4);
+	end_chunk(buf, chunk);
+	end_chunk(buf, root);
+	end_chunk(buf, file);
+}
+
+struct test_asset {
+	const char *name;
+	slv_asset_ctor *new_asset;
+	char **args;
+	struct test_buf buf;
+	size_t num_runs;
+	size_t num_passed;
+};
+
+/*
+ * Whatever passes the check must load, while saving may still fail with an
+ * error (such as a polygon GLU cannot split) but never crash
+ */
+static bool run_test(struct test_asset *test, const struct test_buf *buf)
+{
+	struct slv_err err = {0};
+	struct slv_asset *asset = test->new_asset(test->args, &err);
+	if (!asset)
+		goto print_err;
+	struct slv_stream *stream = slv_new_ms(buf->bytes, buf->sz, &err);
+	if (!stream) {
+		SLV_DEL(asset);
+		goto print_err;
+	}
+	bool ret = true;
+	++test->num_runs;
+	bool passed = SLV_CALL(validate, asset, stream);
+	SLV_DEL(stream);
+	if (passed) {
+		++test->num_passed;
+		// Loading starts over, from a stream of its own
+		if (!(stream = slv_new_ms(buf->bytes, buf->sz, &err))) {
+			SLV_DEL(asset);
+			goto print_err;
+		}
+		if (!(ret = SLV_CALL(load, asset, stream)))
+			fprintf(stderr, "%s: passes the check but fails to "
+			        "load: %s\n", test->name, slv_err_msg(&err));
+		else
+			save(asset);
+		SLV_DEL(stream);
+	}
+	SLV_DEL(asset);
+	return ret;
+print_err:
+	fprintf(stderr, "%s: %s\n", test->name, slv_err_msg(&err));
+	return false;
+}
+
+/*
+ * Compiled with TEST_CHECK defined, silvie.c is a test which changes every byte
+ * of small made-up SPR and CHR files to a few other values, and runs each of
+ * them through the check, then through extraction if the check passes. Built
+ * with -fsanitize=address, it catches whatever the check lets through to a
+ * crash.
+ */
+int main(void)
+{
+	FILE *pal = fopen(TEST_PAL, "wb");
+	if (!pal)
+		return EXIT_FAILURE;
+	for (size_t i = 0; i < 3 * 256; ++i) // 256 RGB colors
+		fputc((int)i, pal);
+	if (fclose(pal))
+		return EXIT_FAILURE;
+	char *spr_args[] = {"-", TEST_PAL, TEST_GIF, NULL};
+	char *chr_args[] = {"-", TEST_PAL, TEST_3DS, TEST_GIF, TEST_GIF, NULL};
+	struct test_asset tests[] = {
+		{.name = "RLE SPR", .new_asset = slv_new_spr,
+		 .args = spr_args},
+		{.name = "masked SPR", .new_asset = slv_new_spr,
+		 .args = spr_args},
+		{.name = "plain SPR", .new_asset = slv_new_spr,
+		 .args = spr_args},
+		{.name = "CHR", .new_asset = slv_new_chr,
+		 .args = chr_args},
+	};
+	make_spr(&tests[0].buf, SLV_SPR_RLE);
+	make_spr(&tests[1].buf, SLV_SPR_HAS_MASKS);
+	make_spr(&tests[2].buf, SLV_SPR_PLAIN);
+	make_chr(&tests[3].buf);
+	static const unsigned char flips[] = {0x01, 0x80, 0xff};
+	static const unsigned char values[] = {0x00, 0x7f, 0x80, 0xff};
+	bool ret = true;
+	for (size_t i = 0; i < SLV_LEN(tests); ++i) {
+		struct test_asset *test = &tests[i];
+		struct test_buf buf = test->buf;
+		if (!run_test(test, &buf) || !test->num_passed) {
+			fprintf(stderr, "%s: the unchanged file does not "
+			        "pass\n", test->name);
+			ret = false;
+			continue;
+		}
+		for (size_t j = 0; j < buf.sz; ++j) {
+			unsigned char byte = buf.bytes[j];
+			for (size_t k = 0; k < SLV_LEN(flips); ++k) {
+				buf.bytes[j] = (unsigned char)(byte ^ flips[k]);
+				if (!run_test(test, &buf))
+					ret = false;
+			}
+			for (size_t k = 0; k < SLV_LEN(values); ++k) {
+				buf.bytes[j] = values[k];
+				if (values[k] != byte && !run_test(test, &buf))
+					ret = false;
+			}
+			buf.bytes[j] = byte;
+		}
+		printf("%s: %zu files, %zu passed the check\n", test->name,
+		       test->num_runs, test->num_passed);
+	}
+	remove(TEST_PAL);
+	remove(TEST_GIF);
+	remove(TEST_3DS);
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#else
+static void print_io_stats(const struct slv_stream *stream)
+{
+	puts("I/O stats:");
+#define X(stat, desc) printf("\t%-24s%zu\n", desc, stream->stats.stat);
+	SLV_STREAM_STATS(X)
+#undef X
+}
+
+static bool process(struct slv_asset *asset, const struct opts *opts)
 {
 	struct slv_stream *stream;
 	bool ret = false;
-	if (!SLV_CALL(check_args, asset)
-	    || !(stream = slv_new_fs(asset->args[0], asset->err)))
+	// Checking or listing an asset only needs its input
+	if ((!(opts->check || opts->list) || !asset->args[0])
+	    && !SLV_CALL(check_args, asset))
+		goto del_asset;
+	if (opts->list && !asset->ops->list) {
+		slv_set_err(asset->err, SLV_LIB_SLV, SLV_ERR_LIST);
+		goto del_asset;
+	}
+	const char *path = asset->args[0];
+	if (!(stream = strcmp(path, "-")
+	               ? slv_new_mfs(path, opts->buf_sz, asset->err)
+	               : slv_new_stdin(opts->buf_sz, asset->err)))
 		goto del_asset;
-	puts("Loading asset...");
-	if (!SLV_CALL(load, asset, stream)
-	    || ((void)puts("Saving asset..."), !SLV_CALL(save, asset)))
-		goto del_stream;
+	if (opts->list) {
+		if (!SLV_CALL(list, asset, stream, opts->list == LIST_HEADER))
+			goto del_stream;
+	} else if (opts->check) {
+		puts("Checking asset...");
+		if (!SLV_CALL(validate, asset, stream))
+			goto del_stream;
+	} else {
+		puts("Loading asset...");
+		if (!SLV_CALL(load, asset, stream)
+		    || ((void)puts("Saving asset..."),
+		        !save(asset)))
+			goto del_stream;
+	}
+	if (opts->io_stats)
+		print_io_stats(stream);
 	ret = true;
 del_stream:
 	SLV_DEL(stream);
@@ -52,12 +415,62 @@ del_asset:
 #define FORMATS(X) \
 	X(chr, "3D model, saved as a 3DS file and a GIF file")          \
 	X(eng, "Dialog text, saved as an XML file")                     \
-	X(pak, "Level archive, saved as a RAW file and 3 BIN files")    \
+	X(pak, "Level archive, saved as a RAW or GIF file and 3 BIN "   \
+	       "files")                                                 \
 	X(raw, "RAW image, saved as a GIF file")                        \
 	X(spr, "Spritesheet, saved as GIF files")
 
+static bool parse_opt(struct opts *opts, const char *arg)
+{
+	static const char buf_sz[] = "--buf-sz=";
+	if (!strncmp(arg, buf_sz, strlen(buf_sz))) {
+		const char *val = arg + strlen(buf_sz);
+		char *end;
+		errno = 0;
+		unsigned long long sz = strtoull(val, &end, 10);
+		if (errno || end == val || *end || *val == '-' || sz > SIZE_MAX)
+			return false;
+		opts->buf_sz = (size_t)sz;
+		return true;
+	}
+	if (!strcmp(arg, "--io-stats")) {
+		opts->io_stats = true;
+		return true;
+	}
+	if (!strcmp(arg, "--check")) {
+		opts->check = true;
+		return true;
+	}
+	if (!strcmp(arg, "--list")) {
+		opts->list = LIST_SECTIONS;
+		return true;
+	}
+	if (!strcmp(arg, "--list=header")) {
+		opts->list = LIST_HEADER;
+		return true;
+	}
+	return false;
+}
+
 int main(int argc, char *argv[])
 {
+	struct opts opts = {
+		.buf_sz = 0,
+		.io_stats = false,
+		.check = false,
+		.list = LIST_NONE,
+	};
+	for (; argc > 1 && !strncmp(argv[1], "--", 2); --argc, ++argv) {
+		if (!parse_opt(&opts, argv[1])) {
+			fprintf(stderr, "Invalid option: %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	// Each of them replaces extraction with a pass of its own
+	if (opts.check && opts.list) {
+		fputs("--check and --list cannot be used together\n", stderr);
+		return EXIT_FAILURE;
+	}
 	if (argc == 1) {
 		puts("This is Silvie, an asset extractor for Silver.\n"
 		     "The following formats are supported:\n\n"
@@ -65,13 +478,29 @@ int main(int argc, char *argv[])
 		     FORMATS(X)
 #undef X
 		     "\nFor usage information on a given format, type:\n\n"
-		     "\tsilvie format");
+		     "\tsilvie format\n\n"
+		     "The input path may be - to read from the standard "
+		     "input.\n\n"
+		     "The following options may precede the format:\n\n"
+		     "\t--buf-sz=N\tRead buffer size in bytes for inputs that\n"
+		     "\t\t\tcannot be memory-mapped (0 means the default)\n"
+		     "\t--io-stats\tPrint input stream counters after loading\n"
+		     "\t--check\t\tOnly run a partial check of the structure "
+		     "of\n\t\t\tthe input, which is the only argument "
+		     "needed\n"
+		     "\t--list\t\tOnly print the section sizes and RAW "
+		     "header of\n\t\t\ta PAK file as JSON, which "
+		     "only needs the input\n"
+		     "\t--list=header\tOnly print the sizes in the RNC "
+		     "header of a PAK\n\t\t\tfile as JSON");
 		return EXIT_FAILURE;
 	}
-	puts("Silvie v0.2.0\n"
-	     "Copyright (C) 2018 Lucas Petitiot.\n"
-	     "This is free software; "
-	     "see the LICENSE file for copying conditions.\n");
+	// Listings are kept alone on the standard output
+	if (!opts.list)
+		puts("Silvie v0.2.0\n"
+		     "Copyright (C) 2018 Lucas Petitiot.\n"
+		     "This is free software; "
+		     "see the LICENSE file for copying conditions.\n");
 	const char *formats[] = {
 #define X(format, desc) #format,
 		FORMATS(X)
@@ -87,7 +516,7 @@ int main(int argc, char *argv[])
 		}[i];
 		struct slv_err err = {0};
 		struct slv_asset *asset = new_asset(&argv[2], &err);
-		if (asset && process(asset))
+		if (asset && process(asset, &opts))
 			return EXIT_SUCCESS;
 		fprintf(stderr, "%s\n", slv_err_msg(&err));
 		return EXIT_FAILURE;
@@ -95,3 +524,4 @@ int main(int argc, char *argv[])
 	fputs("Unsupported format\n", stderr);
 	return EXIT_FAILURE;
 }
+#endif
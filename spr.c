@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "asset.h"
@@ -29,11 +30,82 @@
 #include "stream.h"
 #include "utils.h"
 
+#define HDR_FIELDS(X) \
+	X(file_sz)      \
+	X(file_id)      \
+	X(format)       \
+	X(num_frames)   \
+	X(unk_0)        \
+	X(num_anims)    \
+	X(unk_1)
+
+#define FRAME_INFO_FIELDS(X) \
+	X(sz)                   \
+	X(width)                \
+	X(height)               \
+	X(left)                 \
+	X(top)
+
+#define ANIM_FIELDS(X) \
+	X(num_frames)           \
+	X(delay)                \
+	X(num_indices)          \
+	X(fst_frame_idx)        \
+	X(unk)
+
+static const struct slv_field hdr_fields[] = {
+#define X(field) SLV_FIELD(struct slv_spr_hdr, field),
+	HDR_FIELDS(X)
+#undef X
+};
+
+static const struct slv_field frame_info_fields[] = {
+#define X(field) SLV_FIELD(struct slv_spr_frame_info, field),
+	FRAME_INFO_FIELDS(X)
+#undef X
+};
+
+static const struct slv_field anim_fields[] = {
+#define X(field) SLV_FIELD(struct slv_spr_anim, field),
+	ANIM_FIELDS(X)
+#undef X
+};
+
 static bool check_args(const void *me)
 {
 	return slv_check_args(me, 3, SLV_ERR_SPR_ARGS);
 }
 
+// The animation data from SPINALL.SPR seems to be incorrect
+static void fix_anim(const struct slv_spr_hdr *hdr, size_t idx,
+                     struct slv_spr_anim *anim)
+{
+	if (hdr->file_id == 43 && !idx)
+		anim->num_frames = 30;
+}
+
+// Animations of a single frame are not saved, so their indices go unused
+static bool count_used_indices(const struct slv_spr_anim *anim,
+                               size_t *num_used, struct slv_err *err)
+{
+	*num_used = anim->num_frames > 1 ? anim->num_frames : 0;
+	if (*num_used > anim->num_indices) {
+		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_ANIM);
+		return false;
+	}
+	return true;
+}
+
+static bool check_anim_idx(long idx, unsigned long num_frames,
+                           struct slv_err *err)
+{
+	if (idx < 0 || (unsigned long)idx >= num_frames) {
+		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_ANIM);
+		return false;
+	}
+	return true;
+}
+
 static bool load_anims(struct slv_spr *spr, struct slv_stream *stream)
 {
 	struct slv_spr_hdr *hdr = &spr->hdr;
@@ -46,17 +118,22 @@ static bool load_anims(struct slv_spr *spr, struct slv_stream *stream)
 		return false;
 	for (size_t i = 0; i < hdr->num_anims; ++i) {
 		struct slv_spr_anim *anim = &spr->anims[i];
-		if (!slv_read_le(stream, &anim->num_frames)
-		    || !slv_read_le(stream, &anim->delay)
-		    || !slv_read_le(stream, &anim->num_indices)
+		if (!slv_read_fields(stream, anim_fields, SLV_LEN(anim_fields),
+		                     anim)
 		    || !(anim->indices = slv_malloc(anim->num_indices *
 		                                    sizeof anim->indices[0],
 		                                    stream->err))
-		    || !slv_read_le(stream, &anim->fst_frame_idx)
-		    || !slv_read_le(stream, &anim->unk)
 		    || !slv_read_le_arr(stream, anim->num_indices,
 		                        anim->indices))
 			return false;
+		fix_anim(hdr, i, anim);
+		size_t num_used;
+		if (!count_used_indices(anim, &num_used, stream->err))
+			return false;
+		for (size_t j = 0; j < num_used; ++j)
+			if (!check_anim_idx(anim->indices[j], hdr->num_frames,
+			                    stream->err))
+				return false;
 	}
 	return true;
 }
@@ -65,10 +142,7 @@ static bool load(void *me, struct slv_stream *stream)
 {
 	struct slv_spr *spr = me;
 	struct slv_spr_hdr *hdr = &spr->hdr;
-	if (!slv_read_le(stream, &hdr->file_sz)
-	    || !slv_read_le(stream, &hdr->file_id)
-	    || !slv_read_le(stream, &hdr->format)
-	    || !slv_read_le(stream, &hdr->num_frames)
+	if (!slv_read_fields(stream, hdr_fields, SLV_LEN(hdr_fields), hdr)
 	    || !(spr->frame_infos = slv_malloc(hdr->num_frames *
 	                                       sizeof spr->frame_infos[0],
 	                                       stream->err))
@@ -76,26 +150,13 @@ static bool load(void *me, struct slv_stream *stream)
 	                                 sizeof spr->frames[0],
 	                                 &(struct slv_spr_frame) {0},
 	                                 stream->err))
-	    || !slv_read_le(stream, &hdr->unk_0)
-	    || !slv_read_le(stream, &hdr->num_anims)
-	    || !slv_read_le(stream, &hdr->unk_1))
+	    || !slv_read_fields_arr(stream, frame_info_fields,
+	                            SLV_LEN(frame_info_fields), hdr->num_frames,
+	                            spr->frame_infos,
+	                            sizeof spr->frame_infos[0]))
+		return false;
+	if (hdr->num_anims && !load_anims(spr, stream))
 		return false;
-	for (size_t i = 0; i < hdr->num_frames; ++i) {
-		struct slv_spr_frame_info *frame_info = &spr->frame_infos[i];
-		if (!slv_read_le(stream, &frame_info->sz)
-		    || !slv_read_le(stream, &frame_info->width)
-		    || !slv_read_le(stream, &frame_info->height)
-		    || !slv_read_le(stream, &frame_info->left)
-		    || !slv_read_le(stream, &frame_info->top))
-			return false;
-	}
-	if (hdr->num_anims) {
-		if (!load_anims(spr, stream))
-			return false;
-		// The animation data from SPINALL.SPR seems to be incorrect
-		if (hdr->file_id == 43)
-			spr->anims[0].num_frames = 30;
-	}
 	for (size_t i = 0; i < hdr->num_frames; ++i) {
 		struct slv_spr_frame *frame = &spr->frames[i];
 		if (!slv_read_le(stream, &frame->sz))
@@ -105,8 +166,8 @@ static bool load(void *me, struct slv_stream *stream)
 			            SLV_ERR_SPR_FRAME);
 			return false;
 		}
-		if (!(frame->data = slv_malloc(frame->sz, stream->err))
-		    || !slv_read_buf(stream, frame->data, frame->sz))
+		if (!(frame->data = slv_borrow_buf(stream, frame->sz,
+		                                   &frame->owned)))
 			return false;
 	}
 	if (hdr->file_sz + 4 != stream->pos) {
@@ -116,88 +177,154 @@ static bool load(void *me, struct slv_stream *stream)
 	return true;
 }
 
-static bool read_rle_strides(unsigned char *row, struct slv_stream *stream)
+struct saved_frame {
+	const struct slv_spr_frame_info *info;
+	const unsigned char *buf;
+	unsigned char *owned;
+	unsigned char *mask;
+	bool in_anim;
+};
+
+static bool set_stride_err(struct slv_err *err)
+{
+	slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_STRIDE);
+	return false;
+}
+
+// The row is only checked against its width when it is NULL
+static bool read_rle_strides(unsigned char *row, size_t width,
+                             struct slv_stream *stream)
 {
 	unsigned row_sz;
 	if (!slv_read_le(stream, &row_sz))
 		return false;
-	for (size_t len; row_sz; row += len) {
+	for (size_t x = 0, len; row_sz; x += len) {
 		char num_pixels;
 		if (!slv_read_buf(stream, &num_pixels, 1))
 			return false;
 		--row_sz;
 		if (num_pixels < 0) {
 			len = (size_t)-num_pixels;
-			memset(row, 0, len);
+			if (len > width - x)
+				return set_stride_err(stream->err);
+			if (row)
+				memset(&row[x], 0, len);
 			continue;
 		}
 		len = (size_t)num_pixels;
-		if (!slv_read_buf(stream, row, len))
+		if (len > width - x || len > row_sz)
+			return set_stride_err(stream->err);
+		if (!(row ? slv_read_buf(stream, &row[x], len)
+		          : slv_skip(stream, len, 1)))
 			return false;
 		row_sz -= len;
 	}
 	return true;
 }
 
-struct saved_frame {
-	const struct slv_spr_frame_info *info;
-	unsigned char *buf;
-	unsigned char *mask;
-	bool in_anim;
-	bool free_buf;
-};
+static bool read_mask_strides(unsigned char *row, size_t width,
+                              struct slv_stream *stream)
+{
+	unsigned row_sz;
+	if (!slv_read_le(stream, &row_sz))
+		return false;
+	for (size_t x = 0, len; row_sz--; x += len) {
+		char num_pixels;
+		if (!slv_read_buf(stream, &num_pixels, 1))
+			return false;
+		len = num_pixels < 0 ? (size_t)-num_pixels : (size_t)num_pixels;
+		if (len > width - x)
+			return set_stride_err(stream->err);
+		if (row)
+			memset(&row[x], num_pixels >= 0, len);
+	}
+	return true;
+}
 
-static bool read_rle(const struct slv_spr_frame *frame,
-                     struct saved_frame *saved, struct slv_err *err)
+// Plain pixels follow the masks, and are all there is to plain frames
+static bool check_pixels_sz(const struct slv_spr_frame_info *info, size_t sz,
+                            struct slv_err *err)
 {
-	struct slv_stream *stream = slv_new_ms(frame->data, frame->sz, err);
-	if (!stream)
+	if (info->height && info->width > sz / info->height) {
+		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_FRAME);
 		return false;
+	}
+	return true;
+}
+
+/*
+ * Frames are walked from the current position of the stream, and only
+ * checked when saved is NULL, so that validate goes through the same steps
+ */
+static bool walk_rle(struct slv_stream *stream, size_t sz,
+                     const struct slv_spr_frame_info *info,
+                     struct saved_frame *saved)
+{
+	size_t start = stream->pos;
 	unsigned width;
 	unsigned height;
-	bool ret = false;
 	if (!slv_read_le(stream, &width)
 	    || !slv_read_le(stream, &height))
-		goto del_stream;
-	if (width != saved->info->width
-	    || height != saved->info->height) {
-		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_RES);
-		goto del_stream;
+		return false;
+	if (width != info->width || height != info->height) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_RES);
+		return false;
+	}
+	if (saved) {
+		if (!(saved->owned = slv_malloc(width * height, stream->err)))
+			return false;
+		saved->buf = saved->owned;
 	}
-	if (!(saved->buf = slv_malloc(width * height, err)))
-		goto del_stream;
-	saved->free_buf = true;
 	for (size_t i = 0; i < height; ++i)
-		if (!read_rle_strides(&saved->buf[i * width], stream))
-			goto del_stream;
-	if (frame->sz != stream->pos) {
-		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_FRAME);
-		goto del_stream;
+		if (!read_rle_strides(saved ? &saved->owned[i * width] : NULL,
+		                      width, stream))
+			return false;
+	if (stream->pos - start != sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_FRAME);
+		return false;
 	}
-	ret = true;
-del_stream:
-	SLV_DEL(stream);
-	return ret;
+	return true;
 }
 
-static bool read_mask_strides(unsigned char *row, struct slv_stream *stream)
+// Stops at the plain pixels, which the frame must have room for
+static bool walk_masks(struct slv_stream *stream, size_t sz,
+                       const struct slv_spr_frame_info *info,
+                       struct saved_frame *saved)
 {
-	unsigned row_sz;
-	if (!slv_read_le(stream, &row_sz))
+	size_t start = stream->pos;
+	unsigned long width = info->width;
+	unsigned long height = info->height;
+	unsigned mask_sz;
+	if (!check_pixels_sz(info, sz, stream->err)
+	    || (saved && !(saved->mask = slv_malloc(width * height,
+	                                            stream->err)))
+	    || !slv_read_le(stream, &mask_sz))
 		return false;
-	for (size_t len; row_sz--; row += len) {
-		char num_pixels;
-		if (!slv_read_buf(stream, &num_pixels, 1))
+	for (size_t i = 0; i < height; ++i)
+		if (!read_mask_strides(saved ? &saved->mask[i * width] : NULL,
+		                       width, stream))
 			return false;
-		if (num_pixels < 0) {
-			len = (size_t)-num_pixels;
-			memset(row, 0, len);
-		} else {
-			len = (size_t)num_pixels;
-			memset(row, 1, len);
-		}
+	size_t pos = stream->pos - start;
+	if (mask_sz != pos) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_MASK);
+		return false;
 	}
-	return true;
+	if (pos > sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_FRAME);
+		return false;
+	}
+	return check_pixels_sz(info, sz - pos, stream->err);
+}
+
+static bool read_rle(const struct slv_spr_frame *frame,
+                     struct saved_frame *saved, struct slv_err *err)
+{
+	struct slv_stream *stream = slv_new_ms(frame->data, frame->sz, err);
+	if (!stream)
+		return false;
+	bool ret = walk_rle(stream, frame->sz, saved->info, saved);
+	SLV_DEL(stream);
+	return ret;
 }
 
 static bool read_has_masks(const struct slv_spr_frame *frame,
@@ -206,23 +333,8 @@ static bool read_has_masks(const struct slv_spr_frame *frame,
 	struct slv_stream *stream = slv_new_ms(frame->data, frame->sz, err);
 	if (!stream)
 		return false;
-	unsigned long width = saved->info->width;
-	unsigned long height = saved->info->height;
-	unsigned mask_sz;
-	bool ret = false;
-	if (!(saved->mask = slv_malloc(width * height, err))
-	    || !slv_read_le(stream, &mask_sz))
-		goto del_stream;
-	for (size_t i = 0; i < height; ++i)
-		if (!read_mask_strides(&saved->mask[i * width], stream))
-			goto del_stream;
-	if (mask_sz != stream->pos) {
-		slv_set_err(err, SLV_LIB_SLV, SLV_ERR_SPR_MASK);
-		goto del_stream;
-	}
+	bool ret = walk_masks(stream, frame->sz, saved->info, saved);
 	saved->buf = &frame->data[stream->pos];
-	ret = true;
-del_stream:
 	SLV_DEL(stream);
 	return ret;
 }
@@ -230,40 +342,132 @@ del_stream:
 static bool read_plain(const struct slv_spr_frame *frame,
                        struct saved_frame *saved, struct slv_err *err)
 {
-	(void)err;
 	saved->buf = frame->data;
+	return check_pixels_sz(saved->info, frame->sz, err);
+}
+
+static bool validate_anims(const struct slv_spr_hdr *hdr,
+                           struct slv_stream *stream)
+{
+	if (!slv_skip(stream, hdr->num_anims, 4))
+		return false;
+	for (size_t i = 0; i < hdr->num_anims; ++i) {
+		struct slv_spr_anim anim;
+		size_t num_used;
+		if (!slv_read_fields(stream, anim_fields, SLV_LEN(anim_fields),
+		                     &anim))
+			return false;
+		fix_anim(hdr, i, &anim);
+		if (!count_used_indices(&anim, &num_used, stream->err))
+			return false;
+		for (size_t j = 0; j < num_used; ++j) {
+			long idx;
+			if (!slv_read_le(stream, &idx)
+			    || !check_anim_idx(idx, hdr->num_frames,
+			                       stream->err))
+				return false;
+		}
+		if (!slv_skip(stream, anim.num_indices - num_used, 4))
+			return false;
+	}
 	return true;
 }
 
+static bool validate_frame(unsigned long format, struct slv_stream *stream,
+                           size_t sz, const struct slv_spr_frame_info *info)
+{
+	size_t start = stream->pos;
+	switch (format) {
+	case SLV_SPR_RLE:
+		return walk_rle(stream, sz, info, NULL);
+	case SLV_SPR_HAS_MASKS:
+		return walk_masks(stream, sz, info, NULL)
+		       && slv_skip(stream, sz - (stream->pos - start), 1);
+	case SLV_SPR_PLAIN:
+		return check_pixels_sz(info, sz, stream->err)
+		       && slv_skip(stream, sz, 1);
+	}
+	slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_FORMAT);
+	return false;
+}
+
+// Frames are walked as save would decode them, without keeping their pixels
+static bool validate(const void *me, struct slv_stream *stream)
+{
+	(void)me;
+	struct slv_spr_hdr hdr;
+	if (!slv_read_fields(stream, hdr_fields, SLV_LEN(hdr_fields), &hdr))
+		return false;
+	if (hdr.format > SLV_SPR_PLAIN) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SPR_FORMAT);
+		return false;
+	}
+	size_t info_sz = slv_fields_sz(frame_info_fields,
+	                               SLV_LEN(frame_info_fields));
+	if (hdr.num_frames > SIZE_MAX / info_sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_OVERFLOW);
+		return false;
+	}
+	// The frame infos are checked against the frames that follow the anims
+	struct slv_stream *infos = slv_new_sub(stream, hdr.num_frames * info_sz);
+	if (!infos)
+		return false;
+	bool ret = false;
+	if (!validate_anims(&hdr, stream))
+		goto del_infos;
+	for (size_t i = 0; i < hdr.num_frames; ++i) {
+		struct slv_spr_frame_info info;
+		unsigned long sz;
+		if (!slv_read_fields(infos, frame_info_fields,
+		                     SLV_LEN(frame_info_fields), &info)
+		    || !slv_read_le(stream, &sz))
+			goto del_infos;
+		if (sz != info.sz) {
+			slv_set_err(stream->err, SLV_LIB_SLV,
+			            SLV_ERR_SPR_FRAME);
+			goto del_infos;
+		}
+		if (!validate_frame(hdr.format, stream, sz, &info))
+			goto del_infos;
+	}
+	if (hdr.file_sz + 4 != stream->pos) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_FILE_SZ);
+		goto del_infos;
+	}
+	ret = true;
+del_infos:
+	SLV_DEL(infos);
+	return ret;
+}
+
 static bool save_anim(const struct slv_spr_anim *anim,
                       struct saved_frame *frames, const struct slv_spr *spr,
                       struct slv_gif_opts *opts)
 {
 	if (anim->num_frames <= 1)
 		return true;
-	int left = INT_MAX;
-	int top = INT_MAX;
-	int right = INT_MIN;
-	int bottom = INT_MIN;
+	// Positions and sizes are 32-bit, so their sums cannot overflow here
+	long long left = LLONG_MAX;
+	long long top = LLONG_MAX;
+	long long right = LLONG_MIN;
+	long long bottom = LLONG_MIN;
 	for (size_t i = 0; i < anim->num_frames; ++i) {
 		long idx = anim->indices[i];
 		const struct slv_spr_frame_info *info = &spr->frame_infos[idx];
-		int width;
-		int height;
-		int info_left;
-		int info_top;
-		if (!slv_ul_to_i(info->width, &width, spr->asset.err)
-		    || !slv_ul_to_i(info->height, &height, spr->asset.err)
-		    || !slv_l_to_i(info->left, &info_left, spr->asset.err)
-		    || !slv_l_to_i(info->top, &info_top, spr->asset.err))
-			return false;
-		left = slv_min(left, info_left);
-		top = slv_min(top, info_top);
-		right = slv_max(right, info_left + width);
-		bottom = slv_max(bottom, info_top + height);
+		long long info_right = info->left + (long long)info->width;
+		long long info_bottom = info->top + (long long)info->height;
+		left = info->left < left ? info->left : left;
+		top = info->top < top ? info->top : top;
+		right = info_right > right ? info_right : right;
+		bottom = info_bottom > bottom ? info_bottom : bottom;
+	}
+	// Which also bounds the size and offset of every frame
+	if (right - left > INT_MAX || bottom - top > INT_MAX) {
+		slv_set_err(spr->asset.err, SLV_LIB_SLV, SLV_ERR_OVERFLOW);
+		return false;
 	}
-	opts->width = right - left;
-	opts->height = bottom - top;
+	opts->width = (int)(right - left);
+	opts->height = (int)(bottom - top);
 	struct GifFileType *gif = slv_open_gif(opts, spr->asset.err);
 	if (!gif)
 		return false;
@@ -274,8 +478,8 @@ static bool save_anim(const struct slv_spr_anim *anim,
 		int delay;
 		if (!slv_ul_to_i(anim->delay, &delay, spr->asset.err)
 		    || !slv_fill_gif(gif, &(struct slv_gif_buf_info) {
-			.left = (int)info->left - left,
-			.top = (int)info->top - top,
+			.left = (int)(info->left - left),
+			.top = (int)(info->top - top),
 			.width = (int)info->width,
 			.height = (int)info->height,
 			.buf = frames[idx].buf,
@@ -288,7 +492,7 @@ static bool save_anim(const struct slv_spr_anim *anim,
 	}
 	ret = true;
 close_gif:
-	EGifCloseFile(gif, NULL);
+	slv_close_gif(gif);
 	return ret;
 }
 
@@ -303,7 +507,7 @@ static bool save_frame(struct slv_gif_opts *opts, struct slv_gif_buf_info *info,
 		goto close_gif;
 	ret = true;
 close_gif:
-	EGifCloseFile(gif, NULL);
+	slv_close_gif(gif);
 	return ret;
 }
 
@@ -348,6 +552,7 @@ static bool save(const void *me)
 	if (!slv_read_pal(spr->asset.args[1], pal_colors, spr->asset.err))
 		goto free_frames;
 	struct slv_gif_opts opts = {
+		.writer = spr->asset.writer,
 		.file_path = path,
 		.num_colors = SLV_NUM_PAL_COLORS,
 		.colors = pal_colors,
@@ -393,18 +598,19 @@ static bool save(const void *me)
 			{0, 0, 0},
 			{0xff, 0xff, 0xff},
 		};
-		opts.num_colors = SLV_LEN(mask_colors);
-		opts.colors = mask_colors;
+		// The next frames keep the palette
+		struct slv_gif_opts mask_opts = opts;
+		mask_opts.num_colors = SLV_LEN(mask_colors);
+		mask_opts.colors = mask_colors;
 		buf_info.buf = frames[i].mask;
 		buf_info.alpha = false;
-		if (!save_frame(&opts, &buf_info, spr->asset.err))
+		if (!save_frame(&mask_opts, &buf_info, spr->asset.err))
 			goto free_frames;
 	}
 	ret = true;
 free_frames:
 	for (size_t i = 0; i < hdr->num_frames; ++i) {
-		if (frames[i].free_buf)
-			free(frames[i].buf);
+		free(frames[i].owned);
 		free(frames[i].mask);
 	}
 	free(frames);
@@ -432,7 +638,7 @@ static void del(void *me)
 		del_anims(spr);
 	if (spr->frames)
 		for (size_t i = 0; i < hdr->num_frames; ++i)
-			free(spr->frames[i].data);
+			free(spr->frames[i].owned);
 	free(spr->frames);
 	free(spr);
 }
@@ -440,6 +646,7 @@ static void del(void *me)
 static const struct slv_asset_ops ops = {
 	.check_args = check_args,
 	.load = load,
+	.validate = validate,
 	.save = save,
 	.del = del,
 };
@@ -58,7 +58,8 @@ struct slv_spr_anim {
 
 struct slv_spr_frame {
 	unsigned long sz;
-	unsigned char *data;
+	const unsigned char *data;
+	void *owned;
 };
 
 struct slv_spr {
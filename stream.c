@@ -16,14 +16,23 @@
  * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
 #include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "error.h"
 #include "stream.h"
 #include "utils.h"
@@ -33,18 +42,58 @@ static_assert(CHAR_MIN <= -128, "CHAR_MIN must be at most -128");
 static_assert(INT_MIN <= -32768, "INT_MIN must be at most -32768");
 static_assert(LONG_MIN <= -2147483648, "LONG_MIN must be at most -2147483648");
 
+#if defined(__STDC_IEC_559__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ \
+    && (!defined(__FLOAT_WORD_ORDER__) \
+        || __FLOAT_WORD_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SLV_IEEE_LE
+static_assert(sizeof (float) == sizeof (uint32_t), "float must be 32-bit");
+static_assert(FLT_RADIX == 2 && FLT_MANT_DIG == 24 && FLT_MAX_EXP == 128,
+              "float must be an IEEE-754 binary32");
+#endif
+
 struct fs {
 	struct slv_stream stream;
-	FILE *file;
+	int fd;
+	unsigned char *buf;
+	size_t buf_sz;
+	size_t buf_pos;
+	size_t buf_len;
 };
 
+static bool fs_refill(struct fs *fs)
+{
+	ssize_t len;
+	do
+		len = read(fs->fd, fs->buf, fs->buf_sz);
+	while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		slv_set_errno(fs->stream.err);
+		return false;
+	}
+	if (!len) {
+		slv_set_err(fs->stream.err, SLV_LIB_SLV, SLV_ERR_READ);
+		return false;
+	}
+	fs->buf_pos = 0;
+	fs->buf_len = (size_t)len;
+	++fs->stream.stats.num_refills;
+	return true;
+}
+
 static bool fs_read(void *me, void *buf, size_t sz)
 {
 	struct fs *fs = me;
-	if (slv_fread(buf, sz, 1, fs->file, fs->stream.err) != 1)
-		return false;
-	if (fs->stream.callback)
-		fs->stream.callback(fs->stream.pos, buf, sz);
+	unsigned char *bytes = buf;
+	for (size_t i = 0, len; i < sz; i += len) {
+		if (fs->buf_pos == fs->buf_len && !fs_refill(fs))
+			return false;
+		len = fs->buf_len - fs->buf_pos;
+		if (len > sz - i)
+			len = sz - i;
+		memcpy(&bytes[i], &fs->buf[fs->buf_pos], len);
+		fs->buf_pos += len;
+	}
 	fs->stream.pos += sz;
 	return true;
 }
@@ -52,7 +101,8 @@ static bool fs_read(void *me, void *buf, size_t sz)
 static void fs_del(void *me)
 {
 	struct fs *fs = me;
-	fclose(fs->file);
+	close(fs->fd);
+	free(fs->buf);
 	free(fs);
 }
 
@@ -61,17 +111,26 @@ static const struct slv_stream_ops fs_ops = {
 	.del = fs_del,
 };
 
-struct slv_stream *slv_new_fs(const char *path, struct slv_err *err)
+static struct slv_stream *new_fs(int fd, size_t buf_sz, struct slv_err *err)
 {
+	if (!buf_sz)
+		buf_sz = SLV_FS_BUF_SZ;
 	struct fs *fs = slv_malloc(sizeof *fs, err);
 	if (!fs)
 		return NULL;
-	if (!(fs->file = slv_fopen(path, "rb", err)))
+	if (!(fs->buf = slv_malloc(buf_sz, err)))
 		goto free_fs;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	fs->stream.ops = &fs_ops;
 	fs->stream.pos = 0;
-	fs->stream.callback = NULL;
+	fs->stream.mem = NULL;
+	fs->stream.mem_sz = 0;
+	fs->stream.stats = (struct slv_stream_stats) {0};
 	fs->stream.err = err;
+	fs->fd = fd;
+	fs->buf_sz = buf_sz;
+	fs->buf_pos = 0;
+	fs->buf_len = 0;
 	return &fs->stream;
 free_fs:
 	free(fs);
@@ -80,83 +139,436 @@ free_fs:
 
 struct ms {
 	struct slv_stream stream;
-	const unsigned char *buf;
-	size_t sz;
 };
 
 static bool ms_read(void *me, void *buf, size_t sz)
 {
 	struct ms *ms = me;
-	if (ms->stream.pos + sz > ms->sz) {
+	if (sz > ms->stream.mem_sz - ms->stream.pos) {
 		slv_set_err(ms->stream.err, SLV_LIB_SLV, SLV_ERR_READ);
 		return false;
 	}
-	memcpy(buf, &ms->buf[ms->stream.pos], sz);
-	if (ms->stream.callback)
-		ms->stream.callback(ms->stream.pos, buf, sz);
+	memcpy(buf, &ms->stream.mem[ms->stream.pos], sz);
 	ms->stream.pos += sz;
 	return true;
 }
 
+static const void *ms_peek(void *me, size_t *sz)
+{
+	struct ms *ms = me;
+	*sz = ms->stream.mem_sz - ms->stream.pos;
+	return &ms->stream.mem[ms->stream.pos];
+}
+
+static bool ms_seek(void *me, size_t pos)
+{
+	struct ms *ms = me;
+	if (pos > ms->stream.mem_sz) {
+		slv_set_err(ms->stream.err, SLV_LIB_SLV, SLV_ERR_SEEK);
+		return false;
+	}
+	ms->stream.pos = pos;
+	return true;
+}
+
 static const struct slv_stream_ops ms_ops = {
 	.read = ms_read,
+	.peek = ms_peek,
+	.seek = ms_seek,
 	.del = free,
 };
 
+static void init_ms(struct ms *ms, const struct slv_stream_ops *ops,
+                    const void *buf, size_t sz, struct slv_err *err)
+{
+	ms->stream.ops = ops;
+	ms->stream.pos = 0;
+	ms->stream.stats = (struct slv_stream_stats) {0};
+	ms->stream.err = err;
+	ms->stream.mem = buf;
+	ms->stream.mem_sz = sz;
+}
+
 struct slv_stream *slv_new_ms(const void *buf, size_t sz, struct slv_err *err)
 {
 	struct ms *ms = slv_malloc(sizeof *ms, err);
 	if (!ms)
 		return NULL;
-	ms->stream.ops = &ms_ops;
-	ms->stream.pos = 0;
-	ms->stream.callback = NULL;
-	ms->stream.err = err;
-	ms->buf = buf;
-	ms->sz = sz;
+	init_ms(ms, &ms_ops, buf, sz, err);
 	return &ms->stream;
 }
 
-bool slv_read_buf(struct slv_stream *stream, void *buf, size_t sz)
+struct mfs {
+	struct ms ms;
+	void *map;
+};
+
+static void mfs_del(void *me)
+{
+	struct mfs *mfs = me;
+	munmap(mfs->map, mfs->ms.stream.mem_sz);
+	free(mfs);
+}
+
+static const struct slv_stream_ops mfs_ops = {
+	.read = ms_read,
+	.peek = ms_peek,
+	.seek = ms_seek,
+	.del = mfs_del,
+};
+
+// Takes ownership of fd
+static struct slv_stream *new_mfs(int fd, size_t buf_sz, struct slv_err *err)
+{
+	struct slv_stream *ret = NULL;
+	struct stat st;
+	if (fstat(fd, &st)) {
+		slv_set_errno(err);
+		goto close_fd;
+	}
+	void *map = MAP_FAILED;
+	size_t sz = (size_t)st.st_size;
+	/*
+	 * Pipes, FIFOs and some network filesystems cannot be mapped, nor can
+	 * a standard input which has already been read from
+	 */
+	if (S_ISREG(st.st_mode) && st.st_size > 0
+	    && (uintmax_t)st.st_size <= SIZE_MAX
+	    && !lseek(fd, 0, SEEK_CUR))
+		map = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		if ((ret = new_fs(fd, buf_sz, err)))
+			return ret;
+		goto close_fd;
+	}
+	posix_madvise(map, sz, POSIX_MADV_SEQUENTIAL);
+	struct mfs *mfs = slv_malloc(sizeof *mfs, err);
+	if (!mfs) {
+		munmap(map, sz);
+		goto close_fd;
+	}
+	init_ms(&mfs->ms, &mfs_ops, map, sz, err);
+	mfs->map = map;
+	ret = &mfs->ms.stream;
+close_fd:
+	close(fd);
+	return ret;
+}
+
+struct slv_stream *slv_new_mfs(const char *path, size_t buf_sz,
+                               struct slv_err *err)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		slv_set_errno(err);
+		return NULL;
+	}
+	return new_mfs(fd, buf_sz, err);
+}
+
+// The standard input is left open when the stream is deleted
+struct slv_stream *slv_new_stdin(size_t buf_sz, struct slv_err *err)
+{
+	int fd = dup(STDIN_FILENO);
+	if (fd < 0) {
+		slv_set_errno(err);
+		return NULL;
+	}
+	return new_mfs(fd, buf_sz, err);
+}
+
+// Accounts for reads made through a stream layered over this one
+void slv_merge_stats(struct slv_stream *stream, const struct slv_stream *sub)
+{
+	struct slv_stream_stats *stats = &stream->stats;
+	size_t max_read = stats->max_read;
+#define X(stat, desc) stats->stat += sub->stats.stat;
+	SLV_STREAM_STATS(X)
+#undef X
+	stats->max_read = max_read > sub->stats.max_read ? max_read
+	                                                 : sub->stats.max_read;
+}
+
+bool slv_read_buf_slow(struct slv_stream *stream, void *buf, size_t sz)
 {
+	slv_count_read(stream, sz);
 	return SLV_CALL(read, stream, buf, sz);
 }
 
+// Such streams hand out pointers into their data instead of copying it
+bool slv_can_lend(const struct slv_stream *stream)
+{
+	return stream->ops->peek != NULL;
+}
+
+// The bytes lent are only counted as read by the caller, if at all
+static const void *lend(struct slv_stream *stream, size_t sz)
+{
+	size_t avail;
+	const void *buf = SLV_CALL(peek, stream, &avail);
+	if (sz > avail) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_READ);
+		return NULL;
+	}
+	stream->pos += sz;
+	return buf;
+}
+
+/*
+ * Memory streams lend a pointer into their buffer, which stays valid for the
+ * lifetime of the stream. Other streams copy into a new buffer which is
+ * returned in *owned and must be freed by the caller, unless owned is NULL in
+ * which case lending is mandatory.
+ */
+const void *slv_borrow_buf(struct slv_stream *stream, size_t sz, void **owned)
+{
+	if (owned)
+		*owned = NULL;
+	if (slv_can_lend(stream)) {
+		const void *buf = lend(stream, sz);
+		if (buf) {
+			slv_count_read(stream, sz);
+			++stream->stats.num_borrows;
+		}
+		return buf;
+	}
+	if (!owned) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_READ);
+		return NULL;
+	}
+	void *buf = slv_malloc(sz, stream->err);
+	if (!buf || !slv_read_buf(stream, buf, sz)) {
+		free(buf);
+		return NULL;
+	}
+	return *owned = buf;
+}
+
+#define SKIP_BLOCK_SZ 4096
+
+/*
+ * Streams without a seek operation can only skip forward, by reading and
+ * discarding the bytes in between
+ */
+bool slv_seek(struct slv_stream *stream, size_t pos)
+{
+	if (stream->ops->seek)
+		return SLV_CALL(seek, stream, pos);
+	if (pos < stream->pos) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_SEEK);
+		return false;
+	}
+	unsigned char buf[SKIP_BLOCK_SZ];
+	while (stream->pos < pos) {
+		size_t sz = pos - stream->pos;
+		if (!slv_read_buf(stream, buf, sz < sizeof buf ? sz : sizeof buf))
+			return false;
+	}
+	return true;
+}
+
+bool slv_skip(struct slv_stream *stream, size_t num_elem, size_t elem_sz)
+{
+	if (elem_sz && num_elem > (SIZE_MAX - stream->pos) / elem_sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_OVERFLOW);
+		return false;
+	}
+	return slv_seek(stream, stream->pos + num_elem * elem_sz);
+}
+
+struct sub {
+	struct ms ms;
+	struct slv_stream *parent;
+	void *owned;
+	bool lent;
+};
+
+/*
+ * A range lent by the parent is only counted by the reads made through the
+ * sub-stream. One copied out of it was counted by the parent as it was read, so
+ * only the other counters are merged.
+ */
+static void sub_del(void *me)
+{
+	struct sub *sub = me;
+	struct slv_stream_stats *stats = &sub->ms.stream.stats;
+	if (!sub->lent)
+		stats->num_reads = stats->num_bytes = stats->max_read = 0;
+	slv_merge_stats(sub->parent, &sub->ms.stream);
+	free(sub->owned);
+	free(sub);
+}
+
+static const struct slv_stream_ops sub_ops = {
+	.read = ms_read,
+	.peek = ms_peek,
+	.seek = ms_seek,
+	.del = sub_del,
+};
+
+/*
+ * Consumes the next sz bytes of the parent stream, borrowing them if it can
+ * lend, and serves them as a stream of their own, so that reading past the
+ * end of the range fails. The sub-stream must be deleted before its parent.
+ */
+struct slv_stream *slv_new_sub(struct slv_stream *parent, size_t sz)
+{
+	struct sub *sub = slv_malloc(sizeof *sub, parent->err);
+	if (!sub)
+		return NULL;
+	sub->owned = NULL;
+	sub->lent = slv_can_lend(parent);
+	const void *buf = sub->lent ? lend(parent, sz)
+	                            : slv_borrow_buf(parent, sz, &sub->owned);
+	if (!buf) {
+		free(sub);
+		return NULL;
+	}
+	init_ms(&sub->ms, &sub_ops, buf, sz, parent->err);
+	sub->parent = parent;
+	return &sub->ms.stream;
+}
+
+static char *read_lent_str(struct slv_stream *stream)
+{
+	size_t avail;
+	const char *buf = SLV_CALL(peek, stream, &avail);
+	const char *end = memchr(buf, '\0', avail);
+	if (!end) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_READ);
+		return NULL;
+	}
+	size_t sz = (size_t)(end - buf) + 1;
+	char *str = slv_malloc(sz, stream->err);
+	if (!str)
+		return NULL;
+	memcpy(str, buf, sz);
+	slv_count_read(stream, sz);
+	stream->pos += sz;
+	return str;
+}
+
 char *slv_read_str(struct slv_stream *stream)
 {
+	// Strings are copied at once when the terminator can be looked up
+	if (slv_can_lend(stream))
+		return read_lent_str(stream);
 	size_t i = 0;
 	size_t buf_sz = 32;
 	char *tmp;
 	char *str = NULL;
 	do {
-		if ((!(i % buf_sz) && (!(tmp = slv_realloc(str, i + buf_sz,
-		                                           stream->err))
-		                       || !(str = tmp)))
-		    || !slv_read_buf(stream, &str[i], 1)) {
-			free(str);
-			return NULL;
+		if (!(i % buf_sz)) {
+			++stream->stats.num_str_reallocs;
+			if (!(tmp = slv_realloc(str, i + buf_sz, stream->err)))
+				goto free_str;
+			str = tmp;
 		}
+		if (!slv_read_buf(stream, &str[i], 1))
+			goto free_str;
 	} while (str[i++]);
 	return str;
+free_str:
+	free(str);
+	return NULL;
+}
+
+bool slv_skip_str(struct slv_stream *stream)
+{
+	if (slv_can_lend(stream)) {
+		size_t avail;
+		const char *buf = SLV_CALL(peek, stream, &avail);
+		const char *end = memchr(buf, '\0', avail);
+		if (!end) {
+			slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_READ);
+			return false;
+		}
+		return slv_skip(stream, (size_t)(end - buf) + 1, 1);
+	}
+	char ch;
+	do
+		if (!slv_read_buf(stream, &ch, 1))
+			return false;
+	while (ch);
+	return true;
+}
+
+static unsigned long decode_le_u32(const unsigned char *buf)
+{
+	unsigned long ul = 0;
+	for (size_t i = 0; i < 4; ++i)
+		ul |= (unsigned long)buf[i] << i * CHAR_BIT;
+	return ul;
+}
+
+static long decode_le_s32(const unsigned char *buf)
+{
+	unsigned long ul = decode_le_u32(buf);
+	return (ul & 0x80000000UL) ? -(long)(~ul & 0xffffffffUL) - 1L : (long)ul;
 }
 
+#if !defined(SLV_IEEE_LE) || defined(TEST_F32)
+static float decode_portable_le_f32(const unsigned char *buf)
+{
+	double sign = (buf[3] & 0x80) ? -1. : 1.;
+	int exponent = (buf[3] & 0x7f) << 1 | (buf[2] & 0x80) >> 7;
+	unsigned long sig_ul = (unsigned long)(buf[2] & 0x7f) << 2 * CHAR_BIT
+	                       | (unsigned long)buf[1] << CHAR_BIT
+	                       | (unsigned long)buf[0];
+	double sig = sig_ul / 8388608.;
+	if (!exponent)
+		if (!sig_ul)
+			return (float)sign * 0.f;
+		else
+			return (float)(sign * ldexp(sig, -126));
+	else if (exponent == 0xff)
+		if (!sig_ul)
+			return (float)sign * HUGE_VALF;
+		else
+#ifdef NAN
+			return NAN;
+#else
+			return 0.f;
+#endif
+	else
+		return (float)(sign * ldexp(sig + 1., exponent - 127));
+}
+#endif
+
+#ifdef SLV_IEEE_LE
+static float decode_le_f32(const unsigned char *buf)
+{
+	uint32_t u;
+	float f;
+	memcpy(&u, buf, sizeof u);
+	// NaNs are made quiet and positive, as by the portable decoder above
+	if ((u & 0x7fffffffU) > 0x7f800000U)
+		return NAN;
+	memcpy(&f, &u, sizeof f);
+	return f;
+}
+#else
+static float decode_le_f32(const unsigned char *buf)
+{
+	return decode_portable_le_f32(buf);
+}
+#endif
+
 bool slv_read_le_u32(struct slv_stream *stream, unsigned long *ul)
 {
 	unsigned char buf[4];
 	if (!slv_read_buf(stream, buf, sizeof buf))
 		return false;
-	*ul = 0;
-	for (size_t i = 0; i < sizeof buf; ++i)
-		*ul |= (unsigned long)buf[i] << i * CHAR_BIT;
+	*ul = decode_le_u32(buf);
 	return true;
 }
 
 bool slv_read_le_s32(struct slv_stream *stream, long *l)
 {
-	unsigned long ul;
-	if (!slv_read_le(stream, &ul))
+	unsigned char buf[4];
+	if (!slv_read_buf(stream, buf, sizeof buf))
 		return false;
-	*l = (ul & 0x80000000UL) ? -(long)(~ul & 0xffffffffUL) - 1L : (long)ul;
+	*l = decode_le_s32(buf);
 	return true;
 }
 
@@ -185,53 +597,145 @@ bool slv_read_le_f32(struct slv_stream *stream, float *f)
 	unsigned char buf[4];
 	if (!slv_read_buf(stream, buf, sizeof buf))
 		return false;
-	double sign = (buf[3] & 0x80) ? -1. : 1.;
-	int exponent = (buf[3] & 0x7f) << 1 | (buf[2] & 0x80) >> 7;
-	unsigned long sig_ul = (unsigned long)(buf[2] & 0x7f) << 2 * CHAR_BIT
-	                       | (unsigned long)buf[1] << CHAR_BIT
-	                       | (unsigned long)buf[0];
-	double sig = sig_ul / 8388608.;
-	if (!exponent)
-		if (!sig_ul)
-			*f = (float)sign * 0.f;
-		else
-			*f = (float)(sign * ldexp(sig, -126));
-	else if (exponent == 0xff)
-		if (!sig_ul)
-			*f = (float)sign * HUGE_VALF;
-		else
-#ifdef NAN
-			*f = NAN;
-#else
-			*f = 0.f;
-#endif
-	else
-		*f = (float)(sign * ldexp(sig + 1., exponent - 127));
+	*f = decode_le_f32(buf);
 	return true;
 }
 
-bool slv_read_le_u32_arr(struct slv_stream *stream, size_t num_u32,
-                         unsigned long *arr)
+/*
+ * Arrays are decoded by blocks rather than element by element: straight from
+ * the buffer of memory streams, or through a bounce buffer for other streams.
+ */
+#define ARR_BLOCK_SZ 4096
+
+static const unsigned char *read_arr_block(struct slv_stream *stream,
+                                           size_t *num_elem, size_t elem_sz,
+                                           unsigned char *buf)
+{
+	if (*num_elem > SIZE_MAX / elem_sz) {
+		slv_set_err(stream->err, SLV_LIB_SLV, SLV_ERR_OVERFLOW);
+		return NULL;
+	}
+	if (slv_can_lend(stream))
+		return slv_borrow_buf(stream, *num_elem * elem_sz, NULL);
+	if (*num_elem > ARR_BLOCK_SZ / elem_sz)
+		*num_elem = ARR_BLOCK_SZ / elem_sz;
+	return slv_read_buf(stream, buf, *num_elem * elem_sz) ? buf : NULL;
+}
+
+typedef void arr_decoder(const unsigned char *, size_t, void *);
+
+static bool read_le_arr(struct slv_stream *stream, size_t num_elem, void *arr,
+                        size_t elem_sz, arr_decoder *decode)
 {
-	for (size_t i = 0; i < num_u32; ++i)
-		if (!slv_read_le(stream, &arr[i]))
+	unsigned char buf[ARR_BLOCK_SZ];
+	for (size_t i = 0, num; i < num_elem; i += num) {
+		num = num_elem - i;
+		const unsigned char *block = read_arr_block(stream, &num, 4, buf);
+		if (!block)
 			return false;
+		decode(block, num, &((unsigned char *)arr)[i * elem_sz]);
+	}
 	return true;
 }
 
+static void decode_le_u32_arr(const unsigned char *buf, size_t num, void *arr)
+{
+	unsigned long *ul = arr;
+	for (size_t i = 0; i < num; ++i)
+		ul[i] = decode_le_u32(&buf[4 * i]);
+}
+
+static void decode_le_s32_arr(const unsigned char *buf, size_t num, void *arr)
+{
+	long *l = arr;
+	for (size_t i = 0; i < num; ++i)
+		l[i] = decode_le_s32(&buf[4 * i]);
+}
+
+static void decode_le_f32_arr(const unsigned char *buf, size_t num, void *arr)
+{
+	float *f = arr;
+	for (size_t i = 0; i < num; ++i)
+		f[i] = decode_le_f32(&buf[4 * i]);
+}
+
+bool slv_read_le_u32_arr(struct slv_stream *stream, size_t num_u32,
+                         unsigned long *arr)
+{
+	return read_le_arr(stream, num_u32, arr, sizeof arr[0],
+	                   decode_le_u32_arr);
+}
+
 bool slv_read_le_s32_arr(struct slv_stream *stream, size_t num_s32, long *arr)
 {
-	for (size_t i = 0; i < num_s32; ++i)
-		if (!slv_read_le(stream, &arr[i]))
-			return false;
-	return true;
+	return read_le_arr(stream, num_s32, arr, sizeof arr[0],
+	                   decode_le_s32_arr);
 }
 
 bool slv_read_le_f32_arr(struct slv_stream *stream, size_t num_f32, float *arr)
 {
-	for (size_t i = 0; i < num_f32; ++i)
-		if (!slv_read_le(stream, &arr[i]))
+	return read_le_arr(stream, num_f32, arr, sizeof arr[0],
+	                   decode_le_f32_arr);
+}
+
+static const size_t field_szs[] = {
+	[SLV_FIELD_LE_U32] = 4,
+	[SLV_FIELD_LE_S32] = 4,
+	[SLV_FIELD_LE_F32] = 4,
+};
+
+static void decode_fields(const struct slv_field *fields, size_t num_fields,
+                          const unsigned char *buf, unsigned char *obj)
+{
+	for (size_t i = 0; i < num_fields; ++i) {
+		const struct slv_field *field = &fields[i];
+		void *dst = &obj[field->off];
+		switch (field->type) {
+		case SLV_FIELD_LE_U32:
+			*(unsigned long *)dst = decode_le_u32(buf);
+			break;
+		case SLV_FIELD_LE_S32:
+			*(long *)dst = decode_le_s32(buf);
+			break;
+		case SLV_FIELD_LE_F32:
+			*(float *)dst = decode_le_f32(buf);
+			break;
+		}
+		buf += field_szs[field->type];
+	}
+}
+
+size_t slv_fields_sz(const struct slv_field *fields, size_t num_fields)
+{
+	size_t sz = 0;
+	for (size_t i = 0; i < num_fields; ++i)
+		sz += field_szs[fields[i].type];
+	return sz;
+}
+
+bool slv_read_fields(struct slv_stream *stream, const struct slv_field *fields,
+                     size_t num_fields, void *obj)
+{
+	return slv_read_fields_arr(stream, fields, num_fields, 1, obj, 0);
+}
+
+bool slv_read_fields_arr(struct slv_stream *stream,
+                         const struct slv_field *fields, size_t num_fields,
+                         size_t num_elem, void *arr, size_t elem_sz)
+{
+	size_t rec_sz = slv_fields_sz(fields, num_fields);
+	assert(rec_sz && rec_sz <= ARR_BLOCK_SZ);
+	unsigned char buf[ARR_BLOCK_SZ];
+	for (size_t i = 0, num; i < num_elem; i += num) {
+		num = num_elem - i;
+		const unsigned char *block = read_arr_block(stream, &num, rec_sz,
+		                                            buf);
+		if (!block)
 			return false;
+		unsigned char *obj = &((unsigned char *)arr)[i * elem_sz];
+		for (size_t j = 0; j < num; ++j, block += rec_sz, obj += elem_sz)
+			decode_fields(fields, num_fields, block, obj);
+	}
 	return true;
 }
 
@@ -245,3 +749,40 @@ bool slv_read_be_u32(struct slv_stream *stream, unsigned long *ul)
 		*ul |= (unsigned long)buf[sizeof buf - i - 1] << i * CHAR_BIT;
 	return true;
 }
+
+#ifdef TEST_F32
+#define MAX_PRINTED_DIFFS 16
+
+/*
+ * Compiled with TEST_F32 defined, stream.c is a test which checks that the fast
+ * float decoder gives the same bits as the portable one for all 2^32 inputs
+ */
+int main(void)
+{
+#ifdef SLV_IEEE_LE
+	unsigned long num_diffs = 0;
+	uint32_t u = 0;
+	do {
+		unsigned char buf[4];
+		for (size_t i = 0; i < sizeof buf; ++i)
+			buf[i] = (unsigned char)(u >> i * CHAR_BIT);
+		float fast = decode_le_f32(buf);
+		float portable = decode_portable_le_f32(buf);
+		uint32_t fast_u, portable_u;
+		memcpy(&fast_u, &fast, sizeof fast_u);
+		memcpy(&portable_u, &portable, sizeof portable_u);
+		if (fast_u == portable_u)
+			continue;
+		if (num_diffs++ < MAX_PRINTED_DIFFS)
+			printf("0x%08lx: 0x%08lx instead of 0x%08lx\n",
+			       (unsigned long)u, (unsigned long)fast_u,
+			       (unsigned long)portable_u);
+	} while (++u);
+	printf("%lu mismatches\n", num_diffs);
+	return num_diffs != 0;
+#else
+	puts("No fast float decoder on this target");
+	return 0;
+#endif
+}
+#endif
@@ -21,23 +21,75 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 struct slv_err;
 
+#define SLV_STREAM_STATS(X) \
+	X(num_reads, "Read calls")                      \
+	X(num_bytes, "Bytes read")                      \
+	X(max_read, "Largest read")                     \
+	X(num_borrows, "Borrowed buffers")              \
+	X(num_str_reallocs, "String reallocations")     \
+	X(num_refills, "Buffer refills")
+
+struct slv_stream_stats {
+#define X(stat, desc) size_t stat;
+	SLV_STREAM_STATS(X)
+#undef X
+};
+
 struct slv_stream {
 	const struct slv_stream_ops {
 		bool (*read)(void *, void *, size_t);
+		const void *(*peek)(void *, size_t *);
+		bool (*seek)(void *, size_t);
 		void (*del)(void *);
 	} *ops;
 	size_t pos;
-	void (*callback)(size_t, void *, size_t);
+	const unsigned char *mem; // Whole contents of memory streams, or NULL
+	size_t mem_sz;
+	struct slv_stream_stats stats;
 	struct slv_err *err;
 };
 
-struct slv_stream *slv_new_fs(const char *path, struct slv_err *err);
+#define SLV_FS_BUF_SZ 262144
+
 struct slv_stream *slv_new_ms(const void *buf, size_t sz, struct slv_err *err);
-bool slv_read_buf(struct slv_stream *stream, void *buf, size_t sz);
+struct slv_stream *slv_new_mfs(const char *path, size_t buf_sz,
+                               struct slv_err *err);
+struct slv_stream *slv_new_stdin(size_t buf_sz, struct slv_err *err);
+void slv_merge_stats(struct slv_stream *stream, const struct slv_stream *sub);
+struct slv_stream *slv_new_sub(struct slv_stream *parent, size_t sz);
+bool slv_read_buf_slow(struct slv_stream *stream, void *buf, size_t sz);
+
+static inline void slv_count_read(struct slv_stream *stream, size_t sz)
+{
+	struct slv_stream_stats *stats = &stream->stats;
+	++stats->num_reads;
+	stats->num_bytes += sz;
+	if (sz > stats->max_read)
+		stats->max_read = sz;
+}
+
+// Memory streams are read inline, without going through their ops
+static inline bool slv_read_buf(struct slv_stream *stream, void *buf,
+                                size_t sz)
+{
+	if (!stream->mem || sz > stream->mem_sz - stream->pos)
+		return slv_read_buf_slow(stream, buf, sz);
+	slv_count_read(stream, sz);
+	memcpy(buf, &stream->mem[stream->pos], sz);
+	stream->pos += sz;
+	return true;
+}
+
+bool slv_seek(struct slv_stream *stream, size_t pos);
+bool slv_skip(struct slv_stream *stream, size_t num_elem, size_t elem_sz);
+bool slv_can_lend(const struct slv_stream *stream);
+const void *slv_borrow_buf(struct slv_stream *stream, size_t sz, void **owned);
 char *slv_read_str(struct slv_stream *stream);
+bool slv_skip_str(struct slv_stream *stream);
 bool slv_read_le_u32(struct slv_stream *stream, unsigned long *ul);
 bool slv_read_le_s32(struct slv_stream *stream, long *l);
 bool slv_read_le_u16(struct slv_stream *stream, unsigned *u);
@@ -65,6 +117,37 @@ bool slv_read_le_f32_arr(struct slv_stream *stream, size_t num_f32, float *arr);
 	         float *: slv_read_le_f32_arr           \
 	        )((stream), (num_elem), (ptr))
 
+enum slv_field_type {
+	SLV_FIELD_LE_U32,
+	SLV_FIELD_LE_S32,
+	SLV_FIELD_LE_F32,
+};
+
+/*
+ * Describes a fixed-size record field by its offset in the decoded structure;
+ * its encoding follows from the member type, as with slv_read_le
+ */
+struct slv_field {
+	size_t off;
+	enum slv_field_type type;
+};
+
+#define SLV_FIELD(rec, member) \
+	{                                                               \
+		.off = offsetof(rec, member),                           \
+		.type = _Generic(((rec *)NULL)->member,                 \
+		                 unsigned long: SLV_FIELD_LE_U32,       \
+		                 long: SLV_FIELD_LE_S32,                \
+		                 float: SLV_FIELD_LE_F32),              \
+	}
+
+size_t slv_fields_sz(const struct slv_field *fields, size_t num_fields);
+bool slv_read_fields(struct slv_stream *stream, const struct slv_field *fields,
+                     size_t num_fields, void *obj);
+bool slv_read_fields_arr(struct slv_stream *stream,
+                         const struct slv_field *fields, size_t num_fields,
+                         size_t num_elem, void *arr, size_t elem_sz);
+
 bool slv_read_be_u32(struct slv_stream *stream, unsigned long *ul);
 
 #define slv_read_be(stream, ptr) \
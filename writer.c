@@ -0,0 +1,431 @@
+/*
+ * writer.c -- Asynchronous output writer
+ * Copyright (C) 2018 Lucas Petitiot <lucas.petitiot@gmail.com>
+ *
+ * Silvie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silvie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "error.h"
+#include "utils.h"
+#include "writer.h"
+
+#define NUM_THREADS 4
+#define BLOCK_SZ 262144
+#define MAX_IN_FLIGHT 8388608
+
+struct block {
+	struct block *next;
+	size_t sz;
+	unsigned char buf[];
+};
+
+/*
+ * An output file is written by one worker at a time, so that its blocks go out
+ * in order, while different files are written concurrently. Outputs with the
+ * same path are written one after the other, in the order they were opened.
+ */
+struct slv_out {
+	struct slv_out *next; // In the queue
+	struct slv_out *older; // Opened before it
+	struct slv_out *successor; // Opened after it with the same path
+	struct slv_writer *writer;
+	char *path;
+	int fd; // Opened by the worker writing the first block
+	bool created;
+	struct block *cur; // Being filled by the saver
+	struct block *head; // Submitted but not written yet
+	struct block *tail;
+	bool closed;
+	bool dropped; // Closed without its file being kept
+	bool held; // Until the output before it with the same path is finished
+	bool pending; // In the queue or being written
+	bool finished;
+};
+
+/*
+ * Savers submit blocks and return, unless more than MAX_IN_FLIGHT bytes are
+ * waiting to be written. The first error is kept and reported by the next
+ * submission or by slv_flush_writer.
+ */
+struct slv_writer {
+	mtx_t mtx;
+	cnd_t work;
+	cnd_t done;
+	struct slv_out *outs; // Newest first, kept until the writer is deleted
+	struct slv_out *queue_head;
+	struct slv_out *queue_tail;
+	size_t num_pending;
+	size_t in_flight;
+	int errnum;
+	bool stop;
+	size_t num_threads;
+	thrd_t threads[NUM_THREADS];
+	struct slv_err *err;
+};
+
+static int write_block(int fd, const struct block *block)
+{
+	for (size_t pos = 0; pos < block->sz;) {
+		ssize_t len = write(fd, &block->buf[pos], block->sz - pos);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		pos += (size_t)len;
+	}
+	return 0;
+}
+
+/*
+ * Writes the submitted blocks of an output, and closes it once it has been
+ * closed by the saver and everything is written. Called with the lock held,
+ * which is released while writing. Blocks are only dropped after an error, or
+ * when the output itself is dropped, its file being removed if it was created.
+ */
+static bool drain(struct slv_out *out)
+{
+	struct slv_writer *writer = out->writer;
+	for (;;) {
+		struct block *block = out->head;
+		bool closing = out->closed;
+		if (!block && !closing)
+			return false;
+		out->head = out->tail = NULL;
+		int errnum = writer->errnum;
+		bool dropped = out->dropped;
+		mtx_unlock(&writer->mtx);
+		size_t sz = 0;
+		if (out->fd < 0 && !errnum && !dropped) {
+			out->fd = open(out->path, O_WRONLY | O_CREAT | O_TRUNC,
+			               0666);
+			if (out->fd < 0)
+				errnum = errno;
+			else
+				out->created = true;
+		}
+		while (block) {
+			struct block *next = block->next;
+			if (!errnum && !dropped)
+				errnum = write_block(out->fd, block);
+			sz += block->sz;
+			free(block);
+			block = next;
+		}
+		if (closing && out->fd >= 0 && close(out->fd) && !errnum)
+			errnum = errno;
+		if (closing && dropped && out->created) {
+			unlink(out->path);
+			out->created = false;
+		}
+		mtx_lock(&writer->mtx);
+		writer->in_flight -= sz;
+		cnd_broadcast(&writer->done);
+		if (!writer->errnum && !dropped)
+			writer->errnum = errnum;
+		if (closing)
+			return true;
+	}
+}
+
+// Called with the lock held
+static void enqueue(struct slv_out *out)
+{
+	struct slv_writer *writer = out->writer;
+	out->pending = true;
+	out->next = NULL;
+	if (writer->queue_tail)
+		writer->queue_tail->next = out;
+	else
+		writer->queue_head = out;
+	writer->queue_tail = out;
+	++writer->num_pending;
+	cnd_signal(&writer->work);
+}
+
+static int work(void *arg)
+{
+	struct slv_writer *writer = arg;
+	mtx_lock(&writer->mtx);
+	for (;;) {
+		while (!writer->queue_head && !writer->stop)
+			cnd_wait(&writer->work, &writer->mtx);
+		struct slv_out *out = writer->queue_head;
+		if (!out)
+			break;
+		if (!(writer->queue_head = out->next))
+			writer->queue_tail = NULL;
+		if (drain(out)) {
+			out->finished = true;
+			struct slv_out *successor = out->successor;
+			if (successor) {
+				successor->held = false;
+				if (successor->head || successor->closed)
+					enqueue(successor);
+			}
+		}
+		out->pending = false;
+		--writer->num_pending;
+		cnd_broadcast(&writer->done);
+	}
+	mtx_unlock(&writer->mtx);
+	return 0;
+}
+
+static void stop(struct slv_writer *writer)
+{
+	mtx_lock(&writer->mtx);
+	writer->stop = true;
+	cnd_broadcast(&writer->work);
+	mtx_unlock(&writer->mtx);
+	for (size_t i = 0; i < writer->num_threads; ++i)
+		thrd_join(writer->threads[i], NULL);
+	cnd_destroy(&writer->done);
+	cnd_destroy(&writer->work);
+	mtx_destroy(&writer->mtx);
+}
+
+struct slv_writer *slv_new_writer(struct slv_err *err)
+{
+	struct slv_writer *writer = slv_malloc(sizeof *writer, err);
+	if (!writer)
+		return NULL;
+	*writer = (struct slv_writer) {.err = err};
+	if (mtx_init(&writer->mtx, mtx_plain) != thrd_success)
+		goto free_writer;
+	if (cnd_init(&writer->work) != thrd_success)
+		goto destroy_mtx;
+	if (cnd_init(&writer->done) != thrd_success)
+		goto destroy_work;
+	for (; writer->num_threads < NUM_THREADS; ++writer->num_threads)
+		if (thrd_create(&writer->threads[writer->num_threads], work,
+		                writer) != thrd_success) {
+			stop(writer);
+			goto free_writer;
+		}
+	return writer;
+destroy_work:
+	cnd_destroy(&writer->work);
+destroy_mtx:
+	mtx_destroy(&writer->mtx);
+free_writer:
+	slv_set_errno(err);
+	free(writer);
+	return NULL;
+}
+
+// Called with the lock held
+static void wait_idle(struct slv_writer *writer)
+{
+	while (writer->num_pending)
+		cnd_wait(&writer->done, &writer->mtx);
+}
+
+bool slv_flush_writer(struct slv_writer *writer)
+{
+	mtx_lock(&writer->mtx);
+	wait_idle(writer);
+	int errnum = writer->errnum;
+	mtx_unlock(&writer->mtx);
+	if (errnum)
+		slv_set_err(writer->err, SLV_LIB_STD, errnum);
+	return !errnum;
+}
+
+// The outputs must all be closed, and are removed once written
+void slv_discard_writer(struct slv_writer *writer)
+{
+	mtx_lock(&writer->mtx);
+	wait_idle(writer);
+	for (struct slv_out *out = writer->outs; out; out = out->older)
+		if (out->created)
+			unlink(out->path);
+	mtx_unlock(&writer->mtx);
+}
+
+// Outputs still queued are written before the workers stop
+void slv_del_writer(struct slv_writer *writer)
+{
+	stop(writer);
+	for (struct slv_out *out = writer->outs, *older; out; out = older) {
+		older = out->older;
+		free(out->cur);
+		free(out->path);
+		free(out);
+	}
+	free(writer);
+}
+
+/*
+ * The file is only created once the first block is written. An output may not
+ * be opened while another one with the same path is still open, as they would
+ * wait on each other.
+ */
+struct slv_out *slv_open_out(struct slv_writer *writer, const char *path)
+{
+	struct slv_out *out = slv_malloc(sizeof *out, writer->err);
+	if (!out)
+		return NULL;
+	*out = (struct slv_out) {.writer = writer, .fd = -1};
+	if (!(out->path = slv_malloc(strlen(path) + 1, writer->err))) {
+		free(out);
+		return NULL;
+	}
+	strcpy(out->path, path);
+	mtx_lock(&writer->mtx);
+	struct slv_out *prev = writer->outs;
+	while (prev && strcmp(prev->path, path))
+		prev = prev->older;
+	if (prev && !prev->closed) {
+		mtx_unlock(&writer->mtx);
+		slv_set_err(writer->err, SLV_LIB_STD, EBUSY);
+		free(out->path);
+		free(out);
+		return NULL;
+	}
+	if (prev && !prev->finished) {
+		prev->successor = out;
+		out->held = true;
+	}
+	out->older = writer->outs;
+	writer->outs = out;
+	mtx_unlock(&writer->mtx);
+	return out;
+}
+
+// Allocation failures are kept too, as the output is left incomplete
+static bool fail(struct slv_writer *writer, int errnum)
+{
+	mtx_lock(&writer->mtx);
+	if (!writer->errnum)
+		writer->errnum = errnum;
+	mtx_unlock(&writer->mtx);
+	slv_set_err(writer->err, SLV_LIB_STD, errnum);
+	return false;
+}
+
+static bool submit(struct slv_out *out, struct block *block, bool close)
+{
+	struct slv_writer *writer = out->writer;
+	mtx_lock(&writer->mtx);
+	if (block) {
+		while (writer->in_flight
+		       && writer->in_flight + block->sz > MAX_IN_FLIGHT
+		       && !writer->errnum)
+			cnd_wait(&writer->done, &writer->mtx);
+		block->next = NULL;
+		if (out->tail)
+			out->tail->next = block;
+		else
+			out->head = block;
+		out->tail = block;
+		writer->in_flight += block->sz;
+	}
+	if (close)
+		out->closed = true;
+	if (!out->pending && !out->held)
+		enqueue(out);
+	int errnum = writer->errnum;
+	mtx_unlock(&writer->mtx);
+	if (errnum && !out->dropped)
+		slv_set_err(writer->err, SLV_LIB_STD, errnum);
+	return !errnum;
+}
+
+/*
+ * Returns the room left in the block being filled, which is never empty, for
+ * the saver to fill in place and then commit
+ */
+void *slv_reserve_out(struct slv_out *out, size_t *sz)
+{
+	struct block *block = out->cur;
+	if (!block) {
+		if (!(block = malloc(sizeof *block + BLOCK_SZ))) {
+			*sz = 0;
+			fail(out->writer, ENOMEM);
+			return NULL;
+		}
+		block->sz = 0;
+		out->cur = block;
+	}
+	*sz = BLOCK_SZ - block->sz;
+	return &block->buf[block->sz];
+}
+
+bool slv_commit_out(struct slv_out *out, size_t sz)
+{
+	struct block *block = out->cur;
+	block->sz += sz;
+	if (block->sz < BLOCK_SZ)
+		return true;
+	out->cur = NULL;
+	return submit(out, block, false);
+}
+
+bool slv_write_out(struct slv_out *out, const void *buf, size_t sz)
+{
+	const unsigned char *pos = buf;
+	while (sz) {
+		size_t room;
+		void *dst = slv_reserve_out(out, &room);
+		if (!dst)
+			return false;
+		if (room > sz)
+			room = sz;
+		memcpy(dst, pos, room);
+		pos += room;
+		sz -= room;
+		if (!slv_commit_out(out, room))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Every output must be closed, even after an error. The last block is shrunk so
+ * that only what it holds is in flight.
+ */
+bool slv_close_out(struct slv_out *out)
+{
+	struct block *block = out->cur;
+	if (block) {
+		struct block *shrunk = realloc(block,
+		                               sizeof *block + block->sz);
+		if (shrunk)
+			block = shrunk;
+	}
+	out->cur = NULL;
+	return submit(out, block, true);
+}
+
+// Closes an output whose contents are not wanted, removing its file if need be
+void slv_drop_out(struct slv_out *out)
+{
+	free(out->cur);
+	out->cur = NULL;
+	mtx_lock(&out->writer->mtx);
+	out->dropped = true;
+	mtx_unlock(&out->writer->mtx);
+	submit(out, NULL, true);
+}
@@ -0,0 +1,40 @@
+/*
+ * writer.h -- Asynchronous output writer
+ * Copyright (C) 2018 Lucas Petitiot <lucas.petitiot@gmail.com>
+ *
+ * Silvie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silvie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silvie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLV_WRITER_H
+#define SLV_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct slv_err;
+struct slv_out;
+struct slv_writer;
+
+struct slv_writer *slv_new_writer(struct slv_err *err);
+bool slv_flush_writer(struct slv_writer *writer);
+void slv_discard_writer(struct slv_writer *writer);
+void slv_del_writer(struct slv_writer *writer);
+struct slv_out *slv_open_out(struct slv_writer *writer, const char *path);
+void *slv_reserve_out(struct slv_out *out, size_t *sz);
+bool slv_commit_out(struct slv_out *out, size_t sz);
+bool slv_write_out(struct slv_out *out, const void *buf, size_t sz);
+bool slv_close_out(struct slv_out *out);
+void slv_drop_out(struct slv_out *out);
+
+#endif // SLV_WRITER_H